@@ -31,16 +31,21 @@ namespace bwtmerge
 
 //------------------------------------------------------------------------------
 
-BWT::BWT()
+bool BWT::dense_headers = false;
+
+BWT::BWT() :
+  directory_shift(0)
 {
 }
 
-BWT::BWT(const BWT& source)
+BWT::BWT(const BWT& source) :
+  directory_shift(0)
 {
   this->copy(source);
 }
 
-BWT::BWT(BWT&& source)
+BWT::BWT(BWT&& source) :
+  directory_shift(0)
 {
   *this = std::move(source);
 }
@@ -57,17 +62,11 @@ BWT::copy(const BWT& source)
   this->data = source.data;
   for(size_type c = 0; c < SIGMA; c++) { this->samples[c] = source.samples[c]; }
 
-  this->block_boundaries = source.block_boundaries;
-  this->block_rank = source.block_rank;
-  this->block_select = source.block_select;
-  this->setVectors();
-}
+  this->block_starts = source.block_starts;
+  this->block_directory = source.block_directory;
+  this->directory_shift = source.directory_shift;
 
-void
-BWT::setVectors()
-{
-  this->block_rank.set_vector(&(this->block_boundaries));
-  this->block_select.set_vector(&(this->block_boundaries));
+  this->headers = source.headers;
 }
 
 void
@@ -78,9 +77,10 @@ BWT::swap(BWT& source)
     std::swap(this->header, source.header);
     this->data.swap(source.data);
     for(size_type c = 0; c < SIGMA; c++) { this->samples[c].swap(source.samples[c]); }
-    this->block_boundaries.swap(source.block_boundaries);
-    sdsl::util::swap_support(this->block_rank, source.block_rank, &(this->block_boundaries), &(source.block_boundaries));
-    sdsl::util::swap_support(this->block_select, source.block_select, &(this->block_boundaries), &(source.block_boundaries));
+    this->block_starts.swap(source.block_starts);
+    this->block_directory.swap(source.block_directory);
+    std::swap(this->directory_shift, source.directory_shift);
+    this->headers.swap(source.headers);
   }
 }
 
@@ -100,10 +100,11 @@ BWT::operator=(BWT&& source)
     this->data = std::move(source.data);
     for(size_type c = 0; c < SIGMA; c++) { this->samples[c] = std::move(source.samples[c]); }
 
-    this->block_boundaries = std::move(source.block_boundaries);
-    this->block_rank = std::move(source.block_rank);
-    this->block_select = std::move(source.block_select);
-    this->setVectors();
+    this->block_starts = std::move(source.block_starts);
+    this->block_directory = std::move(source.block_directory);
+    this->directory_shift = source.directory_shift;
+
+    this->headers = std::move(source.headers);
   }
   return *this;
 }
@@ -121,9 +122,9 @@ BWT::serialize(std::ostream& out, sdsl::structure_tree_node* v, std::string name
     std::stringstream ss; ss << "samples_" << c;
     written_bytes += this->samples[c].serialize(out, child, ss.str());
   }
-  written_bytes += this->block_boundaries.serialize(out, child, "block_boundaries");
-  written_bytes += this->block_rank.serialize(out, child, "block_rank");
-  written_bytes += this->block_select.serialize(out, child, "block_select");
+  written_bytes += this->block_starts.serialize(out, child, "block_starts");
+  written_bytes += this->block_directory.serialize(out, child, "block_directory");
+  written_bytes += sdsl::write_member(this->directory_shift, out, child, "directory_shift");
 
   sdsl::structure_tree::add_size(child, written_bytes);
   return written_bytes;
@@ -138,13 +139,43 @@ BWT::load(std::istream& in)
     std::cerr << "BWT::load(): Invalid header!" << std::endl;
     std::exit(EXIT_FAILURE);
   }
+  if(this->header.blockSize() != SAMPLE_RATE)
+  {
+    std::cerr << "BWT::load(): The BWT uses " << this->header.blockSize() << "-byte blocks, while this build uses "
+              << SAMPLE_RATE << "-byte blocks" << std::endl;
+    std::exit(EXIT_FAILURE);
+  }
 
   this->data.load(in);
   for(size_type c = 0; c < SIGMA; c++) { this->samples[c].load(in); }
 
-  this->block_boundaries.load(in);
-  this->block_rank.load(in, &(this->block_boundaries));
-  this->block_select.load(in, &(this->block_boundaries));
+  if(this->header.get(NativeHeader::BLOCK_DIRECTORY))
+  {
+    this->block_starts.load(in);
+    this->block_directory.load(in);
+    sdsl::read_member(this->directory_shift, in);
+  }
+  else { this->loadBoundaries(in); }
+
+  if(dense_headers) { this->buildHeaders(); }
+  else { this->headers.clear(); }
+}
+
+void
+BWT::loadBoundaries(std::istream& in)
+{
+  sdsl::sd_vector<> block_boundaries; block_boundaries.load(in);
+  sdsl::sd_vector<>::rank_1_type block_rank; block_rank.load(in, &block_boundaries);
+  sdsl::sd_vector<>::select_1_type block_select; block_select.load(in, &block_boundaries);
+
+  size_type blocks = (this->bytes() + SAMPLE_RATE - 1) / SAMPLE_RATE;
+  this->block_starts = sdsl::int_vector<0>(blocks + 1, 0, bit_length(std::max(this->size(), (size_type)1)));
+  for(size_type block = 1; block <= blocks; block++)
+  {
+    this->block_starts[block] = block_select(block) + 1;
+  }
+  this->buildDirectory();
+  this->header.set(NativeHeader::BLOCK_DIRECTORY);
 }
 
 //------------------------------------------------------------------------------
@@ -212,8 +243,89 @@ mergeRA(RankArray& ra, RABuffer& ra_buffer)
   ra.close();
 }
 
+/*
+  Collects the comp value counts of each block while the merged BWT is written, so
+  that building rank/select does not have to decode the BWT again. Runs written with
+  Run::write() are only decoded when they finish a block, while bytes copied in bulk
+  are decoded as short runs. The counts of each finished block are stored as
+  SIGMA ByteCode-encoded integers.
+*/
+struct BlockCollector
+{
+  BlockArray block_counts;
+  size_type  pending[BWT::SIGMA];
+
+  BlockCollector() { this->reset(); }
+
+  void reset() { for(size_type c = 0; c < BWT::SIGMA; c++) { this->pending[c] = 0; } }
+
+  void finishBlock()
+  {
+    for(size_type c = 0; c < BWT::SIGMA; c++) { ByteCode::write(this->block_counts, this->pending[c]); }
+    this->reset();
+  }
+
+  // Called after writing 'run' to data, starting from byte 'start'.
+  inline void add(const BlockArray& data, size_type start, range_type run)
+  {
+    size_type end = data.size();
+    if(end % BWT::SAMPLE_RATE != 0 && start / BWT::SAMPLE_RATE == end / BWT::SAMPLE_RATE)
+    {
+      this->pending[run.first] += run.second; return;
+    }
+    while(start < end)
+    {
+      range_type part = Run::read(data, start);
+      this->pending[part.first] += part.second;
+      if(start % BWT::SAMPLE_RATE == 0) { this->finishBlock(); }
+    }
+  }
+
+  /*
+    Called after appending raw bytes to data, starting from byte 'start'. The bytes
+    must encode short runs, which take a single byte each.
+  */
+  inline void addShortRuns(const BlockArray& data, size_type start)
+  {
+    size_type end = data.size();
+    while(start < end)
+    {
+      size_type limit = std::min(end, (start / BWT::SAMPLE_RATE + 1) * BWT::SAMPLE_RATE);
+      const BlockArray::value_type* bytes = data.pointer(start);
+      for(size_type i = 0; i < limit - start; i++)
+      {
+        range_type run = Run::decodeBasic(bytes[i]);
+        this->pending[run.first] += run.second;
+      }
+      start = limit;
+      if(start % BWT::SAMPLE_RATE == 0) { this->finishBlock(); }
+    }
+  }
+
+  // Finishes the last block if it is incomplete.
+  void flush(const BlockArray& data)
+  {
+    if(data.size() % BWT::SAMPLE_RATE != 0) { this->finishBlock(); }
+  }
+};
+
+inline void
+writeRun(BlockArray& data, range_type run, BlockCollector& collector)
+{
+  size_type start = data.size();
+  Run::write(data, run);
+  collector.add(data, start, run);
+}
+
+inline void
+writeRun(BlockArray& data, range_type run, sdsl::int_vector<64>& counts, BlockCollector& collector)
+{
+  counts[run.first] += run.second;
+  writeRun(data, run, collector);
+}
+
 void
-mergeBWT(BWT& a, BWT& b, BWT& result, sdsl::int_vector<64>& counts, RABuffer& ra_buffer)
+mergeBWT(BWT& a, BWT& b, BWT& result, sdsl::int_vector<64>& counts, RABuffer& ra_buffer, BlockCollector& collector)
 {
   std::vector<RABuffer::run_type> in_buffer;
   in_buffer.reserve(RABuffer::BUFFER_SIZE);
@@ -236,8 +348,7 @@ mergeBWT(BWT& a, BWT& b, BWT& result, sdsl::int_vector<64>& counts, RABuffer& ra
         size_type length = std::min(curr.first - a_seq_pos, a_run.second);
         if(out_buffer.add(a_run.first, length))
         {
-          Run::write(result.data, out_buffer.run);
-          counts[out_buffer.run.first] += out_buffer.run.second;
+          writeRun(result.data, out_buffer.run, counts, collector);
         }
         a_run.second -= length; a_seq_pos += length;
         if(a_run.second == 0 && a_rle_pos < a.data.size())
@@ -250,8 +361,7 @@ mergeBWT(BWT& a, BWT& b, BWT& result, sdsl::int_vector<64>& counts, RABuffer& ra
         size_type length = std::min(curr.second, b_run.second);
         if(out_buffer.add(b_run.first, length))
         {
-          Run::write(result.data, out_buffer.run);
-          counts[out_buffer.run.first] += out_buffer.run.second;
+          writeRun(result.data, out_buffer.run, counts, collector);
         }
         b_run.second -= length; curr.second -= length;
         if(b_run.second == 0 && b_rle_pos < b.data.size())
@@ -268,8 +378,7 @@ mergeBWT(BWT& a, BWT& b, BWT& result, sdsl::int_vector<64>& counts, RABuffer& ra
   {
     if(out_buffer.add(a_run))
     {
-      Run::write(result.data, out_buffer.run);
-      counts[out_buffer.run.first] += out_buffer.run.second;
+      writeRun(result.data, out_buffer.run, counts, collector);
     }
     if(a_rle_pos < a.data.size()) { a_run = Run::read(a.data, a_rle_pos); a.data.clearUntil(a_rle_pos); }
     else { a_run.second = 0; }
@@ -277,25 +386,293 @@ mergeBWT(BWT& a, BWT& b, BWT& result, sdsl::int_vector<64>& counts, RABuffer& ra
 
   // Flush the buffer.
   out_buffer.flush();
-  Run::write(result.data, out_buffer.run);
-  counts[out_buffer.run.first] += out_buffer.run.second;
+  writeRun(result.data, out_buffer.run, counts, collector);
+  collector.flush(result.data);
+}
+
+//------------------------------------------------------------------------------
+
+/*
+  Parallel interleaving. The positions of a are partitioned into ranges using the
+  samples in the rank array, so that each range contains a bounded number of rank
+  array runs and positions of a. Each range becomes a chunk that is interleaved
+  independently, reading its part of the rank array with an RARange. The chunks are
+  appended to the merged BWT in order.
+
+  The runs of a chunk are stored without regard to block boundaries, and the first
+  and the last run are stored separately, as they may be merged with the runs of the
+  adjacent chunks. Short runs are always encoded as a single byte, so the body of a
+  chunk can be copied to the merged BWT as such, except for the long runs.
+*/
+struct MergeChunk
+{
+  typedef Run::code_type code_type;
+
+  const static size_type MAX_RUNS   = 256 * KILOBYTE;  // Rank array runs.
+  const static size_type MAX_LENGTH = 64 * MEGABYTE;   // Positions in a.
+
+  MergeChunk(size_type low, size_type high) :
+    a_start(low), a_limit(high), b_start(0), b_limit(0),
+    first(0, 0), last(0, 0), counts{}, done(false)
+  {
+  }
+
+  inline void add(range_type run)
+  {
+    this->counts[run.first] += run.second;
+    if(this->first.second == 0) { this->first = run; return; }
+    if(this->last.second > 0)
+    {
+      if(this->last.second >= Run::MAX_RUN)
+      {
+        this->long_runs.push_back(this->body.size());
+        this->body.push_back(Run::encodeBasic(this->last.first, Run::MAX_RUN));
+        ByteCode::write(this->body, this->last.second - Run::MAX_RUN);
+      }
+      else { this->body.push_back(Run::encodeBasic(this->last.first, this->last.second)); }
+    }
+    this->last = run;
+  }
+
+  // Positions [a_start, a_limit) in a and [b_start, b_limit) in b.
+  size_type                        a_start, a_limit, b_start, b_limit;
+
+  // Output.
+  range_type                       first, last;
+  std::vector<code_type>           body;
+  std::vector<size_type>           long_runs;  // Offsets in body.
+  size_type                        counts[BWT::SIGMA];
+  bool                             done;
+};
+
+/*
+  Hands out chunks to the workers and returns the finished chunks to the consumer in
+  order. Chunk i is constructed from bounds[i] and bounds[i + 1], and at most max_chunks
+  chunks are in memory at the same time.
+*/
+template<class Chunk>
+struct OrderedQueue
+{
+  OrderedQueue(const std::vector<size_type>& _bounds, size_type _max_chunks) :
+    bounds(_bounds), chunks(_bounds.size() - 1, nullptr), next(0), appended(0), max_chunks(_max_chunks)
+  {
+  }
+
+  ~OrderedQueue()
+  {
+    for(Chunk* chunk : this->chunks) { delete chunk; }
+  }
+
+  inline size_type size() const { return this->chunks.size(); }
+
+  // Worker: returns the next chunk to process or nullptr if there is none.
+  Chunk* process()
+  {
+    std::unique_lock<std::mutex> lock(this->mtx);
+    this->cv.wait(lock, [this]() { return (this->next >= this->size() || this->next < this->appended + this->max_chunks); });
+    if(this->next >= this->size()) { return nullptr; }
+    Chunk* chunk = new Chunk(this->bounds[this->next], this->bounds[this->next + 1]);
+    this->chunks[this->next++] = chunk;
+    return chunk;
+  }
+
+  void done(Chunk* chunk)
+  {
+    std::unique_lock<std::mutex> lock(this->mtx);
+    chunk->done = true;
+    this->cv.notify_all();
+  }
+
+  // Consumer: returns the next finished chunk in order or nullptr if there is none.
+  Chunk* get()
+  {
+    std::unique_lock<std::mutex> lock(this->mtx);
+    this->cv.wait(lock, [this]()
+    {
+      return (this->appended >= this->size() ||
+              (this->chunks[this->appended] != nullptr && this->chunks[this->appended]->done));
+    });
+    if(this->appended >= this->size()) { return nullptr; }
+    Chunk* chunk = this->chunks[this->appended];
+    this->chunks[this->appended++] = nullptr;
+    this->cv.notify_all();
+    return chunk;
+  }
+
+  std::vector<size_type>   bounds;   // Chunk i covers [bounds[i], bounds[i + 1]).
+  std::vector<Chunk*>      chunks;
+  size_type                next;     // The next chunk to process.
+  size_type                appended; // The next chunk to return to the consumer.
+  size_type                max_chunks;
+
+  std::mutex               mtx;
+  std::condition_variable  cv;
+};
+
+typedef OrderedQueue<MergeChunk> MergeQueue;
+
+inline void
+copyRuns(const BlockArray& source, size_type& rle_pos, range_type& run, size_type n, RunBuffer& buffer, MergeChunk& chunk)
+{
+  while(n > 0)
+  {
+    if(run.second == 0) { run = Run::read(source, rle_pos); }
+    size_type length = std::min(n, run.second);
+    if(buffer.add(run.first, length)) { chunk.add(buffer.run); }
+    run.second -= length; n -= length;
+  }
+}
+
+void
+interleaveChunks(const BWT& a, const BWT& b, const RankArray& ra, MergeQueue& queue)
+{
+  while(true)
+  {
+    MergeChunk* chunk = queue.process();
+    if(chunk == nullptr) { return; }
+
+    // The last chunk also contains the rank array values equal to a.size().
+    size_type high = (chunk->a_limit >= a.size() ? ~(size_type)0 : chunk->a_limit);
+    RARange range(ra, chunk->a_start, high);
+    chunk->b_start = chunk->b_limit = range.offset();
+
+    size_type a_rle_pos = 0, b_rle_pos = 0;
+    range_type a_run(0, 0), b_run(0, 0);
+    if(chunk->a_start < a.size()) { a_run = a.seek(chunk->a_start, a_rle_pos); }
+    if(chunk->b_start < b.size()) { b_run = b.seek(chunk->b_start, b_rle_pos); }
+
+    RunBuffer buffer;
+    size_type a_seq_pos = chunk->a_start;
+    for(; !(range.end()); ++range)
+    {
+      RankArray::run_type curr = *range;
+      copyRuns(a.data, a_rle_pos, a_run, curr.first - a_seq_pos, buffer, *chunk);
+      a_seq_pos = curr.first;
+      copyRuns(b.data, b_rle_pos, b_run, curr.second, buffer, *chunk);
+      chunk->b_limit += curr.second;
+    }
+    copyRuns(a.data, a_rle_pos, a_run, chunk->a_limit - a_seq_pos, buffer, *chunk);
+    buffer.flush(); chunk->add(buffer.run);
+
+    queue.done(chunk);
+  }
+}
+
+// Releases the memory blocks of the input before the block containing position i.
+inline void
+releaseInput(BWT& input, size_type i, size_type& released)
+{
+  size_type limit = BlockArray::block(input.findBlock(i) * BWT::SAMPLE_RATE);
+  for(; released < limit; released++) { input.data.clear(released); }
+}
+
+/*
+  Appends the chunks in order. The block counts are collected at the same time: the
+  runs written with Run::write() are added directly, and only the bytes copied from the
+  chunk bodies are decoded, while they are still in cache.
+*/
+void
+appendChunks(BWT& a, BWT& b, BWT& result, sdsl::int_vector<64>& counts, MergeQueue& queue, BlockCollector& collector)
+{
+  range_type carry(0, 0);
+  size_type a_released = 0, b_released = 0;
+  while(true)
+  {
+    MergeChunk* chunk = queue.get();
+    if(chunk == nullptr) { break; }
+
+    // Merge the first run with the carried run.
+    range_type head = chunk->first;
+    if(carry.first == head.first) { head.second += carry.second; }
+    else { writeRun(result.data, carry, collector); }
+
+    if(chunk->last.second == 0) { carry = head; }
+    else
+    {
+      writeRun(result.data, head, collector);
+      size_type pos = 0;
+      for(size_type offset : chunk->long_runs)
+      {
+        size_type start = result.data.size();
+        result.data.append(chunk->body.data() + pos, offset - pos);
+        collector.addShortRuns(result.data, start);
+        pos = offset; writeRun(result.data, Run::read(chunk->body, pos), collector);
+      }
+      size_type start = result.data.size();
+      result.data.append(chunk->body.data() + pos, chunk->body.size() - pos);
+      collector.addShortRuns(result.data, start);
+      carry = chunk->last;
+    }
+    for(size_type c = 0; c < BWT::SIGMA; c++) { counts[c] += chunk->counts[c]; }
+
+    releaseInput(a, chunk->a_limit, a_released);
+    releaseInput(b, chunk->b_limit, b_released);
+    delete chunk;
+  }
+  writeRun(result.data, carry, collector);
+  collector.flush(result.data);
+}
+
+void
+parallelMerge(BWT& a, BWT& b, BWT& result, sdsl::int_vector<64>& counts, RankArray& ra, size_type max_chunks,
+  BlockCollector& collector)
+{
+  a.headers.clear(); b.headers.clear();
+  size_type threads = Parallel::max_threads;
+  if(max_chunks == 0) { max_chunks = 2 * threads + 1; }
+
+  // Chunk boundaries from the rank array samples and the maximum length.
+  std::vector<size_type> splits = ra.splitPoints(MergeChunk::MAX_RUNS);
+  for(size_type i = MergeChunk::MAX_LENGTH; i < a.size(); i += MergeChunk::MAX_LENGTH) { splits.push_back(i); }
+  std::sort(splits.begin(), splits.end());
+  std::vector<size_type> bounds(1, 0);
+  for(size_type split : splits)
+  {
+    if(split > bounds.back() && split < a.size()) { bounds.push_back(split); }
+  }
+  bounds.push_back(std::max(a.size(), bounds.back()));
+
+  ra.openFiles();
+  MergeQueue queue(bounds, max_chunks);
+  std::vector<std::thread> workers(threads);
+  for(size_type i = 0; i < threads; i++)
+  {
+    workers[i] = std::thread(interleaveChunks, std::cref(a), std::cref(b), std::cref(ra), std::ref(queue));
+  }
+  appendChunks(a, b, result, counts, queue, collector);
+  for(size_type i = 0; i < threads; i++) { workers[i].join(); }
+  ra.closeFiles();
 }
 
 //------------------------------------------------------------------------------
 
-BWT::BWT(BWT& a, BWT& b, RankArray& ra)
+BWT::BWT(BWT& a, BWT& b, RankArray& ra, size_type max_chunks)
 {
 #ifdef VERBOSE_STATUS_INFO
   double start = readTimer();
 #endif
 
-  a.destroy(); b.destroy();
-  RABuffer ra_buffer;
+  /*
+    With multiple threads, the rank array is partitioned and the chunks are interleaved
+    in parallel. Otherwise the BWTs are interleaved in a single pass. In both cases, the
+    block counts for rank/select are collected while writing the merged BWT.
+  */
   sdsl::int_vector<64> counts(SIGMA, 0);
-
-  std::thread producer(mergeRA, std::ref(ra), std::ref(ra_buffer));
-  mergeBWT(a, b, *this, counts, ra_buffer);
-  producer.join();
+  BlockCollector collector;
+  bool parallel = (Parallel::max_threads > 1);
+  if(parallel)
+  {
+    parallelMerge(a, b, *this, counts, ra, max_chunks, collector);
+    a.destroy(); b.destroy();
+  }
+  else
+  {
+    a.destroy(); b.destroy();
+    RABuffer ra_buffer;
+    std::thread producer(mergeRA, std::ref(ra), std::ref(ra_buffer));
+    mergeBWT(a, b, *this, counts, ra_buffer, collector);
+    producer.join();
+  }
 
 #ifdef VERBOSE_STATUS_INFO
   double midpoint = readTimer();
@@ -305,7 +682,7 @@ BWT::BWT(BWT& a, BWT& b, RankArray& ra)
   this->header.sequences = a.sequences() + b.sequences();
   this->header.bases = a.size() + b.size();
   this->header.setOrder(a.header.order());
-  this->build(counts);
+  this->build(counts, collector.block_counts);
 
 #ifdef VERBOSE_STATUS_INFO
   double seconds = readTimer() - midpoint;
@@ -317,24 +694,24 @@ BWT::BWT(BWT& a, BWT& b, RankArray& ra)
 
 size_type
 BWT::rank(size_type i, comp_type c) const
+{
+  return this->rank(i, c, this->findBlock(i));
+}
+
+size_type
+BWT::rank(size_type i, comp_type c, size_type block) const
 {
   if(c >= SIGMA) { return 0; }
   if(i > this->size()) { i = this->size(); }
 
-  size_type block = this->block_rank(i);
-  size_type res = this->samples[c].sum(block);
-  size_type rle_pos = block * SAMPLE_RATE;
-  size_type seq_pos = (block > 0 ? this->block_select(block) + 1 : 0);
-
-  while(seq_pos < i)
+  size_type res = this->blockCount(block, c);
+  size_type seq_pos = this->blockStart(block);
+  if(seq_pos < i)
   {
-    range_type run = Run::read(this->data, rle_pos);
-    seq_pos += run.second;  // The starting position of the next run.
-    if(run.first == c)
-    {
-      res += run.second;  // Number of c's before the next run.
-      if(seq_pos > i) { res -= seq_pos - i; }
-    }
+    size_type counts[SIGMA] = {}; comp_type last = 0;
+    seq_pos += RunBlock::ranks(this->data.pointer(block * SAMPLE_RATE), i - seq_pos, counts, last);
+    res += counts[c];
+    if(last == c) { res -= seq_pos - i; }
   }
 
   return res;
@@ -343,33 +720,39 @@ BWT::rank(size_type i, comp_type c) const
 void
 BWT::ranks(size_type i, ranks_type& results) const
 {
-  if(i > this->size()) { i = this->size(); }
+  this->ranks(i, results, this->findBlock(i));
+}
 
-  size_type block = this->block_rank(i);
-  for(size_type c = 1; c < SIGMA; c++) { results[c] = this->samples[c].sum(block); }
-  size_type rle_pos = block * SAMPLE_RATE;
-  size_type seq_pos = (block > 0 ? this->block_select(block) + 1 : 0);
+void
+BWT::ranks(size_type i, ranks_type& results, size_type block) const
+{
+  if(i > this->size()) { i = this->size(); }
 
-  size_type prev = 0;
-  while(seq_pos < i)
+  size_type seq_pos = this->blockStart(block);
+  size_type counts[SIGMA] = {}; comp_type last = 0;
+  if(seq_pos < i)
   {
-    range_type run = Run::read(this->data, rle_pos);
-    seq_pos += run.second;  // The starting position of the next run.
-    results[run.first] += run.second; prev = run.first;
+    seq_pos += RunBlock::ranks(this->data.pointer(block * SAMPLE_RATE), i - seq_pos, counts, last);
+    counts[last] -= seq_pos - i;
   }
-  results[prev] -= seq_pos - i;
+  for(size_type c = 1; c < SIGMA; c++) { results[c] = this->blockCount(block, c) + counts[c]; }
 }
 
 void
 BWT::ranks(range_type range, rank_ranges_type& results) const
+{
+  this->ranks(range, results, this->findBlock(std::min(range.first, this->size() - 1)));
+}
+
+void
+BWT::ranks(range_type range, rank_ranges_type& results, size_type block) const
 {
   range.first = std::min(range.first, this->size() - 1);
   range.second = std::min(range.second, this->size() - 1);
   for(size_type c = 1; c < SIGMA; c++) { results[c] = range_type(0, 0); }
 
-  size_type block = this->block_rank(range.first);
   size_type rle_pos = block * SAMPLE_RATE;
-  size_type seq_pos = (block > 0 ? this->block_select(block) + 1 : 0);
+  size_type seq_pos = this->blockStart(block);
 
   // Compute the ranks within the block until range.first.
   range_type run(0, 0);
@@ -396,7 +779,7 @@ BWT::ranks(range_type range, rank_ranges_type& results) const
   {
     if(results[c].second > results[c].first)
     {
-      size_type temp = this->samples[c].sum(block);
+      size_type temp = this->blockCount(block, c);
       results[c].first += temp; results[c].second += temp;
     }
   }
@@ -410,9 +793,9 @@ BWT::select(size_type i, comp_type c) const
   if(i > this->count(c)) { return this->size(); }
 
   size_type block = this->samples[c].inverse(i - 1);
-  size_type count = this->samples[c].sum(block);
+  size_type count = this->blockCount(block, c);
   size_type rle_pos = block * SAMPLE_RATE;
-  size_type seq_pos = (block > 0 ? this->block_select(block) + 1 : 0);
+  size_type seq_pos = this->blockStart(block);
   while(true)
   {
     range_type run = Run::read(this->data, rle_pos);
@@ -431,9 +814,9 @@ BWT::operator[](size_type i) const
 {
   if(i >= this->size()) { return 0; }
 
-  size_type block = this->block_rank(i);
+  size_type block = this->findBlock(i);
   size_type rle_pos = block * SAMPLE_RATE;
-  size_type seq_pos = (block > 0 ? this->block_select(block) + 1 : 0);
+  size_type seq_pos = this->blockStart(block);
   while(true)
   {
     range_type run = Run::read(this->data, rle_pos);
@@ -444,23 +827,21 @@ BWT::operator[](size_type i) const
 
 range_type
 BWT::inverse_select(size_type i) const
+{
+  return this->inverse_select(i, this->findBlock(i));
+}
+
+range_type
+BWT::inverse_select(size_type i, size_type block) const
 {
   range_type run(0, 0);
   if(i >= this->size()) { return run; }
 
-  size_type block = this->block_rank(i);
-  size_type rle_pos = block * SAMPLE_RATE;
-  size_type seq_pos = (block > 0 ? this->block_select(block) + 1 : 0);
+  size_type seq_pos = this->blockStart(block);
+  size_type counts[SIGMA] = {}; comp_type last = 0;
+  seq_pos += RunBlock::ranks(this->data.pointer(block * SAMPLE_RATE), i + 1 - seq_pos, counts, last);
 
-  size_type ranks[SIGMA] = {};
-  while(seq_pos <= i)
-  {
-    run = Run::read(this->data, rle_pos);
-    seq_pos += run.second;  // The starting position of the next run.
-    ranks[run.first] += run.second; // Number of c's before the next run.
-  }
-
-  return range_type(this->samples[run.first].sum(block) + ranks[run.first] - (seq_pos - i), run.first);
+  return range_type(this->blockCount(block, last) + counts[last] - (seq_pos - i), last);
 }
 
 //------------------------------------------------------------------------------
@@ -473,41 +854,243 @@ BWT::setHeader(const sdsl::int_vector<64>& counts)
   for(size_type c = 0; c < counts.size(); c++) { this->header.bases += counts[c]; }
 }
 
+/*
+  The length of a BWT block and the number of occurrences of each comp value in it.
+  Because runs do not continue past block boundaries, the blocks can be summarized
+  independently.
+*/
+struct BlockSummary
+{
+  size_type length;
+  size_type counts[BWT::SIGMA];
+};
+
+/*
+  A range of blocks [first, limit) in BWT::build(). The workers fill block_starts for
+  the range and store the comp value counts of each block as SIGMA ByteCode-encoded
+  integers. The counts are then added to the samples in order.
+*/
+struct BlockRange
+{
+  // A multiple of 64, so that the ranges never share a word in block_starts.
+  const static size_type BLOCKS = 64 * KILOBYTE;
+
+  BlockRange(size_type _first, size_type _limit) :
+    first(_first), limit(_limit), done(false)
+  {
+  }
+
+  size_type  first, limit;
+  BlockArray counts;
+  bool       done;
+};
+
+typedef OrderedQueue<BlockRange> RangeQueue;
+
+// Sets lengths[i] to the total length of the blocks in range i.
 void
-BWT::build(const sdsl::int_vector<64>& counts)
+rangeLengths(ParallelLoop& loop, const BlockArray& data, std::vector<size_type>& lengths)
 {
-  size_type blocks = (this->bytes() + SAMPLE_RATE - 1) / SAMPLE_RATE;
-  sdsl::sd_vector_builder block_ends(this->size(), blocks);
-  sdsl::sd_vector_builder block_counts[SIGMA];
-  for(size_type c = 0; c < SIGMA; c++)
+  while(true)
   {
-    block_counts[c] = sdsl::sd_vector_builder(counts[c] + blocks, blocks);
+    range_type range = loop.next();
+    if(Range::empty(range)) { break; }
+    for(size_type i = range.first; i <= range.second; i++)
+    {
+      size_type rle_pos = i * BlockRange::BLOCKS * BWT::SAMPLE_RATE;
+      size_type limit = std::min(rle_pos + BlockRange::BLOCKS * BWT::SAMPLE_RATE, data.size());
+      size_type length = 0;
+      while(rle_pos < limit) { length += Run::read(data, rle_pos).second; }
+      lengths[i] = length;
+    }
   }
+}
 
-  // Scan the BWT and determine block boundaries and ranks.
-  size_type seq_pos = 0, rle_pos = 0;
-  sdsl::int_vector<64> cumulative(SIGMA, 0);
-  while(rle_pos < this->bytes())
+// Range i starts from sequence position starts[i].
+void
+summarizeRanges(const BlockArray& data, const std::vector<size_type>& starts, sdsl::int_vector<0>& block_starts,
+  RangeQueue& queue)
+{
+  while(true)
   {
-    range_type run = Run::read(this->data, rle_pos);
-    seq_pos += run.second; cumulative[run.first] += run.second;
-    if(rle_pos >= this->bytes() || rle_pos % SAMPLE_RATE == 0)
+    BlockRange* range = queue.process();
+    if(range == nullptr) { break; }
+    size_type seq_pos = starts[range->first / BlockRange::BLOCKS];
+    for(size_type block = range->first; block < range->limit; block++)
     {
-      block_ends.set(seq_pos - 1);
-      for(size_type c = 0; c < SIGMA; c++)
+      block_starts[block] = seq_pos;
+      size_type counts[BWT::SIGMA] = {};
+      size_type rle_pos = block * BWT::SAMPLE_RATE;
+      size_type limit = std::min(rle_pos + BWT::SAMPLE_RATE, data.size());
+      while(rle_pos < limit)
       {
-        block_counts[c].set(cumulative[c]); cumulative[c]++;
+        range_type run = Run::read(data, rle_pos);
+        counts[run.first] += run.second; seq_pos += run.second;
       }
+      for(size_type c = 0; c < BWT::SIGMA; c++) { ByteCode::write(range->counts, counts[c]); }
     }
+    queue.done(range);
   }
+}
 
-  // Build rank/select support.
-  this->block_boundaries = sdsl::sd_vector<>(block_ends);
-  sdsl::util::init_support(this->block_rank, &(this->block_boundaries));
-  sdsl::util::init_support(this->block_select, &(this->block_boundaries));
-  for(size_type c = 0; c < SIGMA; c++)
+/*
+  Adds the block summaries in order to the block directory and the samples.
+*/
+struct SampleBuilder
+{
+  sdsl::sd_vector_builder block_counts[BWT::SIGMA];
+  size_type               seq_pos, block;
+  size_type               cumulative[BWT::SIGMA];
+
+  SampleBuilder(BWT& bwt, const sdsl::int_vector<64>& counts, size_type blocks) :
+    seq_pos(0), block(0)
   {
-    this->samples[c] = CumulativeArray(block_counts[c]);
+    bwt.block_starts = sdsl::int_vector<0>(blocks + 1, 0, bit_length(std::max(bwt.size(), (size_type)1)));
+    for(size_type c = 0; c < BWT::SIGMA; c++)
+    {
+      this->block_counts[c] = sdsl::sd_vector_builder(counts[c] + blocks, blocks);
+      this->cumulative[c] = 0;
+    }
+  }
+
+  inline void add(BWT& bwt, const BlockSummary& summary)
+  {
+    this->seq_pos += summary.length; this->block++;
+    bwt.block_starts[this->block] = this->seq_pos;
+    this->addCounts(summary.counts);
+  }
+
+  // Adds the counts of the next block to the samples only.
+  inline void addCounts(const size_type* counts)
+  {
+    for(size_type c = 0; c < BWT::SIGMA; c++)
+    {
+      this->cumulative[c] += counts[c];
+      this->block_counts[c].set(this->cumulative[c]); this->cumulative[c]++;
+    }
+  }
+
+  void finish(BWT& bwt)
+  {
+    for(size_type c = 0; c < BWT::SIGMA; c++)
+    {
+      bwt.samples[c] = CumulativeArray(this->block_counts[c]);
+    }
+  }
+};
+
+void
+BWT::build(const sdsl::int_vector<64>& counts)
+{
+  size_type blocks = (this->bytes() + SAMPLE_RATE - 1) / SAMPLE_RATE;
+  SampleBuilder builder(*this, counts, blocks);
+
+  /*
+    Determine block boundaries and ranks. The blocks are partitioned into ranges. The
+    threads first determine the length of each range, and the starting positions of
+    the ranges are their prefix sums. Then the threads summarize the ranges and fill
+    block_starts, while this thread adds the counts to the samples in order.
+  */
+  size_type threads = Parallel::max_threads;
+  std::vector<size_type> bounds;
+  for(size_type block = 0; block < blocks; block += BlockRange::BLOCKS) { bounds.push_back(block); }
+  bounds.push_back(blocks);
+  size_type ranges = bounds.size() - 1;
+  std::vector<size_type> starts(ranges, 0);
+  if(ranges > 0)
+  {
+    ParallelLoop loop(0, ranges, ranges, threads);
+    loop.execute(rangeLengths, std::cref(this->data), std::ref(starts));
+  }
+  size_type seq_pos = 0;
+  for(size_type i = 0; i < ranges; i++)
+  {
+    size_type length = starts[i]; starts[i] = seq_pos; seq_pos += length;
+  }
+
+  RangeQueue queue(bounds, 2 * threads + 1);
+  std::vector<std::thread> workers(threads);
+  for(size_type i = 0; i < threads; i++)
+  {
+    workers[i] = std::thread(summarizeRanges, std::cref(this->data), std::cref(starts),
+      std::ref(this->block_starts), std::ref(queue));
+  }
+  while(true)
+  {
+    BlockRange* range = queue.get();
+    if(range == nullptr) { break; }
+    size_type pos = 0, block_counts[SIGMA];
+    for(size_type block = range->first; block < range->limit; block++)
+    {
+      ByteCode::read(range->counts, pos, block_counts, SIGMA);
+      builder.addCounts(block_counts);
+    }
+    delete range;
+  }
+  for(size_type i = 0; i < threads; i++) { workers[i].join(); }
+  this->block_starts[blocks] = seq_pos;
+
+  builder.finish(*this);
+  this->finishBuild();
+}
+
+void
+BWT::build(const sdsl::int_vector<64>& counts, const BlockArray& block_counts)
+{
+  size_type blocks = (this->bytes() + SAMPLE_RATE - 1) / SAMPLE_RATE;
+  SampleBuilder builder(*this, counts, blocks);
+
+  size_type pos = 0;
+  BlockSummary summary;
+  for(size_type block = 0; block < blocks; block++)
+  {
+    ByteCode::read(block_counts, pos, summary.counts, SIGMA);
+    summary.length = 0;
+    for(size_type c = 0; c < SIGMA; c++) { summary.length += summary.counts[c]; }
+    builder.add(*this, summary);
+  }
+
+  builder.finish(*this);
+  this->finishBuild();
+}
+
+void
+BWT::finishBuild()
+{
+  this->buildDirectory();
+  this->header.set(NativeHeader::BLOCK_DIRECTORY);
+  this->header.setBlockSize(SAMPLE_RATE);
+  if(dense_headers) { this->buildHeaders(); }
+  else { this->headers.clear(); }
+}
+
+void
+BWT::buildDirectory()
+{
+  // Sample the positions about once per block.
+  size_type blocks = this->block_starts.size() - 1;
+  this->directory_shift = (blocks > 0 ? bit_length(this->size() / blocks) - 1 : 0);
+
+  size_type samples = (this->size() >> this->directory_shift) + 1;
+  this->block_directory = sdsl::int_vector<0>(samples, 0, bit_length(std::max(blocks, (size_type)1)));
+  for(size_type sample = 0, block = 0; sample < samples; sample++)
+  {
+    size_type pos = sample << this->directory_shift;
+    while(block < blocks && this->block_starts[block + 1] <= pos) { block++; }
+    this->block_directory[sample] = block;
+  }
+}
+
+void
+BWT::buildHeaders()
+{
+  size_type blocks = this->block_starts.size() - 1;
+  this->headers.resize(blocks + 1);
+  for(size_type block = 0; block <= blocks; block++)
+  {
+    BlockHeaders::Header& header = this->headers[block];
+    header.start = this->block_starts[block]; header.padding = 0;
+    for(size_type c = 0; c < SIGMA; c++) { header.ranks[c] = this->samples[c].sum(block); }
   }
 }
 
@@ -515,9 +1098,25 @@ void
 BWT::destroy()
 {
   for(size_type c = 0; c < SIGMA; c++) { sdsl::util::clear(this->samples[c]); }
-  sdsl::util::clear(this->block_boundaries);
-  sdsl::util::clear(this->block_rank);
-  sdsl::util::clear(this->block_select);
+  sdsl::util::clear(this->block_starts);
+  sdsl::util::clear(this->block_directory);
+  this->headers.clear();
+}
+
+//------------------------------------------------------------------------------
+
+range_type
+BWT::seek(size_type i, size_type& rle_pos) const
+{
+  size_type block = this->findBlock(i);
+  rle_pos = block * SAMPLE_RATE;
+  size_type seq_pos = this->blockStart(block);
+  while(true)
+  {
+    range_type run = Run::read(this->data, rle_pos);
+    seq_pos += run.second;  // Past the run.
+    if(seq_pos > i) { run.second = seq_pos - i; return run; }
+  }
 }
 
 //------------------------------------------------------------------------------
@@ -49,6 +49,16 @@ public:
   const static size_type SAMPLE_RATE = Run::BLOCK_SIZE;
   const static size_type SIGMA       = Run::SIGMA;
 
+  // Build dense block headers in addition to the compact samples.
+  static bool dense_headers;
+
+  /*
+    Estimated memory usage of an interleaved chunk in the parallel merge. A chunk covers
+    at most 64M positions of the first BWT, and its body rarely takes more than a byte
+    per position.
+  */
+  const static size_type CHUNK_MEMORY = 64 * MEGABYTE;
+
   typedef std::array<size_type, SIGMA>  ranks_type;
   typedef std::array<range_type, SIGMA> rank_ranges_type;
 
@@ -68,9 +78,10 @@ public:
 
   /*
     This constructor interleaves the source BWTs according to the rank array. All the
-    input structures will be destroyed in the process.
+    input structures will be destroyed in the process. The parallel merge keeps at most
+    max_chunks interleaved chunks in memory (0 = 2 * threads + 1).
   */
-  BWT(BWT& a, BWT&b, RankArray& ra);
+  BWT(BWT& a, BWT&b, RankArray& ra, size_type max_chunks = 0);
 
 //------------------------------------------------------------------------------
 
@@ -108,6 +119,12 @@ public:
   inline size_type size() const { return this->header.bases; }
   inline size_type sequences() const { return this->header.sequences; }
   inline size_type bytes() const { return this->data.size(); }
+
+  // Memory used by the dense block headers, which are built but not serialized.
+  inline size_type headerBytes() const
+  {
+    return (dense_headers ? this->block_starts.size() * sizeof(BlockHeaders::Header) : 0);
+  }
   inline size_type count(comp_type c) const { return this->samples[c].sum(); }
 
   size_type rank(size_type i, comp_type c) const;
@@ -129,6 +146,33 @@ public:
   // returns (rank(i, seq[i]), seq[i])
   range_type inverse_select(size_type i) const;
 
+//------------------------------------------------------------------------------
+
+  /*
+    Batched queries. Finding the block containing position i and decoding the block
+    are separate steps, so the memory accesses of independent queries can overlap.
+    Call findBlock() and prefetch() for all queries in the batch before the queries.
+    The block argument must be findBlock(i) (findBlock(range.first) for ranges).
+  */
+  inline size_type findBlock(size_type i) const
+  {
+    i = std::min(i, this->size());
+    size_type block = this->block_directory[i >> this->directory_shift];
+    while(block + 1 < this->block_starts.size() && this->block_starts[block + 1] <= i) { block++; }
+    return block;
+  }
+
+  inline void prefetch(size_type block) const
+  {
+    if(!(this->headers.empty())) { this->headers.prefetch(block); }
+    if(block * SAMPLE_RATE < this->bytes()) { this->data.prefetch(block * SAMPLE_RATE); }
+  }
+
+  size_type rank(size_type i, comp_type c, size_type block) const;
+  void ranks(size_type i, ranks_type& results, size_type block) const;
+  void ranks(range_type range, rank_ranges_type& results, size_type block) const;
+  range_type inverse_select(size_type i, size_type block) const;
+
 //------------------------------------------------------------------------------
 
   template<class ByteVector>
@@ -137,32 +181,22 @@ public:
     if(Range::empty(range) || range.second >= this->size()) { return; }
     buffer.resize(Range::length(range));
 
-    // Find the first character.
-    size_type block = this->block_rank(range.first);
-    size_type rle_pos = block * SAMPLE_RATE;
-    size_type seq_pos = (block > 0 ? this->block_select(block) + 1 : 0);
-    range_type run(0, 0);
-
-    while(true)
-    {
-      run = Run::read(this->data, rle_pos);
-      seq_pos += run.second - 1;  // The last position in the run.
-      if(seq_pos >= range.first) { break; }
-      seq_pos++;  // Move to the first position in the next run.
-    }
-
-    // Fill the buffer.
+    size_type rle_pos = 0;
+    range_type run = this->seek(range.first, rle_pos);
     for(size_type i = range.first; i <= range.second; i++)
     {
-      if(i > seq_pos)
-      {
-        run = Run::read(this->data, rle_pos);
-        seq_pos += run.second;
-      }
-      buffer[i - range.first] = run.first;
+      if(run.second == 0) { run = Run::read(this->data, rle_pos); }
+      buffer[i - range.first] = run.first; run.second--;
     }
   }
 
+  /*
+    Returns (comp value, remaining length) for the run containing position i < size(),
+    where the remaining length counts the positions from i to the end of the run.
+    Sets rle_pos to the start of the next run.
+  */
+  range_type seek(size_type i, size_type& rle_pos) const;
+
   void characterCounts(sdsl::int_vector<64>& counts);
 
   size_type hash() const;
@@ -173,19 +207,49 @@ public:
   BlockArray                       data;
   CumulativeArray                  samples[SIGMA];
 
-  sdsl::sd_vector<>                block_boundaries; // Marks the last sequence position in each block.
-  sdsl::sd_vector<>::rank_1_type   block_rank;
-  sdsl::sd_vector<>::select_1_type block_select;
+  /*
+    Block directory. block_starts[block] is the first sequence position in the block,
+    and the last value is size(). block_directory[j] is the block containing position
+    j << directory_shift. findBlock() continues with a short forward scan.
+  */
+  sdsl::int_vector<0>              block_starts;
+  sdsl::int_vector<0>              block_directory;
+  size_type                        directory_shift;
+
+  BlockHeaders                     headers;          // Optional; replaces block_starts and samples in rank queries.
 
 private:
+  // The sequence position at the start of the block.
+  inline size_type blockStart(size_type block) const
+  {
+    if(!(this->headers.empty())) { return this->headers[block].start; }
+    return this->block_starts[block];
+  }
+
+  // The number of occurrences of c before the block.
+  inline size_type blockCount(size_type block, comp_type c) const
+  {
+    if(!(this->headers.empty())) { return this->headers[block].ranks[c]; }
+    return this->samples[c].sum(block);
+  }
+
   void copy(const BWT& source);
-  void setVectors();
 
   void setHeader(const sdsl::int_vector<64>& counts);
 
-  // Builds/destroys the rank/select structures.
+  /*
+    Builds/destroys the rank/select structures. The second version uses the comp value
+    counts of each block, stored as SIGMA ByteCode-encoded integers per block.
+  */
   void build(const sdsl::int_vector<64>& counts);
+  void build(const sdsl::int_vector<64>& counts, const BlockArray& block_counts);
+  void finishBuild();
+  void buildDirectory();
+  void buildHeaders();
   void destroy();
+
+  // Reads the block boundaries of a BWT serialized without the block directory.
+  void loadBoundaries(std::istream& in);
 };  // class BWT
 
 //------------------------------------------------------------------------------
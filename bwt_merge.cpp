@@ -62,7 +62,7 @@ main(int argc, char** argv)
   MergeParameters parameters;
   std::string pattern_name, output_format;
   std::vector<std::string> input_formats;
-  while((c = getopt(argc, argv, "b:m:r:s:t:d:v:i:o:")) != -1)
+  while((c = getopt(argc, argv, "b:m:r:s:t:M:R:w:f:c:p:HlDd:v:i:o:")) != -1)
   {
     switch(c)
     {
@@ -81,6 +81,37 @@ main(int argc, char** argv)
     case 't':
       parameters.setT(std::stoul(optarg));
       break;
+    case 'M':
+      parameters.setMemory(std::stod(optarg));
+      break;
+    case 'R':
+      parameters.setRM(std::stoul(optarg));
+      break;
+    case 'w':
+      parameters.setWQ(std::stoul(optarg));
+      break;
+    case 'f':
+      parameters.setFI(std::stoul(optarg));
+      break;
+    case 'c':
+      if(!RunCodec::parse(optarg, RunCodec::codec))
+      {
+        std::cerr << "bwt_merge: Invalid rank array codec: " << optarg << std::endl;
+        std::exit(EXIT_FAILURE);
+      }
+      break;
+    case 'p':
+      BlockPool::setRetained(std::stoul(optarg));
+      break;
+    case 'H':
+      BlockPool::huge_pages = true;
+      break;
+    case 'l':
+      parameters.setLevelOrder(true);
+      break;
+    case 'D':
+      BWT::dense_headers = true;
+      break;
     case 'd':
       parameters.setTemp(optarg);
       break;
@@ -145,6 +176,11 @@ main(int argc, char** argv)
   {
     std::cout << "Patterns:         " << pattern_name << std::endl;
   }
+  std::cout << "Rank kernel:      " << RunBlock::kernel_name << std::endl;
+  std::cout << "ByteCode kernel:  " << ByteCode::kernel_name << std::endl;
+  std::cout << "RA codec:         " << RunCodec::name(RunCodec::codec) << std::endl;
+  std::cout << "Block pool:       " << inMegabytes(BlockPool::max_retained) << " MB" << std::endl;
+  std::cout << "Huge pages:       " << (BlockPool::huge_pages ? "enabled" : "disabled") << std::endl;
   std::cout << std::endl;
   std::cout << parameters;
   std::cout << std::endl;
@@ -196,7 +232,21 @@ main(int argc, char** argv)
   double seconds = readTimer() - start;
   std::cout << "Total time:       " << seconds << " seconds (" << (inMegabytes(bytes_added) / seconds)
             << " MB/s)" << std::endl;
-  std::cout << "Peak memory:      " << inGigabytes(memoryUsage()) << " GB" << std::endl;
+  std::cout << "Peak memory:      " << inGigabytes(memoryUsage()) << " GB";
+  if(parameters.memory_budget > 0)
+  {
+    std::cout << " (budget " << inGigabytes(parameters.memory_budget) << " GB)";
+  }
+  std::cout << std::endl;
+  std::cout << "Block pool:       " << BlockPool::hits << " hits, " << BlockPool::misses << " misses, peak "
+            << inGigabytes(BlockPool::peak_in_use * BlockArray::BLOCK_SIZE) << " GB in use" << std::endl;
+  if(BlockPool::huge_pages)
+  {
+    std::cout << "Huge pages:       " << BlockPool::hugetlb_blocks << " blocks with MAP_HUGETLB, "
+              << BlockPool::advised_blocks << " blocks with MADV_HUGEPAGE, "
+              << BlockPool::misses - BlockPool::hugetlb_blocks - BlockPool::advised_blocks << " blocks without; "
+              << inGigabytes(BlockPool::transparentHugePages()) << " GB of transparent huge pages in use" << std::endl;
+  }
   std::cout << std::endl;
 
   return 0;
@@ -221,9 +271,24 @@ printUsage()
             << MergeParameters::defaultSB() << " / thread)" << std::endl;
   std::cerr << "  -t N          Use N parallel threads (default: " << MergeParameters::defaultT()
             << " on this system)" << std::endl;
+  std::cerr << "  -M N          Derive the buffer sizes from a memory budget of N gigabytes" << std::endl;
+  std::cerr << "  -R N          Keep up to N megabytes of the rank array in memory (default: "
+            << MergeParameters::defaultRM() << ")" << std::endl;
+  std::cerr << "  -w N          Allow N buffers to wait for the background writer (default: "
+            << MergeParameters::defaultWQ() << ")" << std::endl;
+  std::cerr << "  -f N          Merge at most N temporary files at once (default: "
+            << MergeParameters::defaultFI() << ")" << std::endl;
+  std::cerr << "  -c codec      Encode the rank array with the given codec (bytecode or packed; default: "
+            << RunCodec::name(RunCodec::codec) << ")" << std::endl;
+  std::cerr << "  -p N          Keep up to N megabytes of released memory blocks for reuse (default: "
+            << BlockPool::defaultRetained() << ")" << std::endl;
+  std::cerr << "  -H            Back memory blocks with 2 MB huge pages when possible" << std::endl;
+  std::cerr << "  -l            Build the rank array in level order instead of depth-first order" << std::endl;
+  std::cerr << "  -D            Use dense block headers for faster rank queries" << std::endl;
   std::cerr << std::endl;
 
-  std::cerr << "  -d directory  Use the given directory for temporary files (default: .)" << std::endl;
+  std::cerr << "  -d dirs       Use the given directories for temporary files (default: .)" << std::endl;
+  std::cerr << "                Multiple comma-separated directories can be provided." << std::endl;
   std::cerr << "  -v filename   Verify by querying with patterns from the given file" << std::endl;
   std::cerr << std::endl;
 
@@ -289,10 +354,36 @@ merge(FMI& index, FMI& increment, const MergeParameters& parameters)
 {
   double increment_mb = inMegabytes(increment.size());
 
+  MergeParameters fitted = parameters;
+  if(parameters.memory_budget > 0)
+  {
+    size_type input_bytes = index.memoryBytes() + increment.memoryBytes();
+    if(!(fitted.fitBudget(input_bytes)))
+    {
+      std::cerr << "bwt_merge: Memory budget " << inGigabytes(parameters.memory_budget)
+                << " GB is too small for inputs of " << inGigabytes(input_bytes) << " GB" << std::endl;
+      std::exit(EXIT_FAILURE);
+    }
+    std::cout << "Memory budget:    " << inGigabytes(fitted.memory_budget) << " GB (inputs "
+              << inGigabytes(input_bytes) << " GB, buffers " << inGigabytes(fitted.bufferMemory()) << " GB)" << std::endl;
+    std::cout << "Run buffers:      "
+              << inMegabytes(fitted.run_buffer_size * sizeof(MergeParameters::run_type)) << " MB" << std::endl;
+    std::cout << "Thread buffers:   " << inMegabytes(fitted.thread_buffer_size) << " MB" << std::endl;
+    std::cout << "Merge buffers:    " << fitted.merge_buffers << std::endl;
+    std::cout << "Threads:          " << fitted.threads << std::endl;
+    std::cout << "Merge chunks:     " << fitted.merge_chunks << std::endl;
+    std::cout << "Block pool:       " << inMegabytes(BlockPool::max_retained) << " MB" << std::endl;
+    std::cout << std::endl;
+  }
+
+  // The BWT merge uses Parallel::max_threads, so it must follow the fitted thread count.
+  size_type max_threads = Parallel::max_threads;
+  Parallel::max_threads = fitted.threads;
   double start = readTimer();
-  FMI temp(index, increment, parameters);
+  FMI temp(index, increment, fitted);
   index.swap(temp);
   double seconds = readTimer() - start;
+  Parallel::max_threads = max_threads;
   std::cout << "BWTs merged in " << seconds << " seconds ("
             << (increment_mb / seconds) << " MB/s)" << std::endl;
   std::cout << std::endl;
@@ -22,7 +22,9 @@
   SOFTWARE.
 */
 
-#include <stack>
+#include <cmath>
+#include <condition_variable>
+#include <deque>
 
 #include "fmi.h"
 
@@ -136,6 +138,24 @@ FMI::load<NativeFormat>(const std::string& filename)
 
 //------------------------------------------------------------------------------
 
+/*
+  The budget is checked against the peak memory usage reported by the operating system.
+  Exceeding the budget is not an error, because the buffer sizes are only estimates.
+*/
+bool
+withinBudget(const MergeParameters& parameters)
+{
+  return (parameters.memory_budget == 0 || memoryUsage() <= parameters.memory_budget);
+}
+
+void
+budgetWarning(const MergeParameters& parameters, const std::string& caller)
+{
+  std::lock_guard<std::mutex> lock(Parallel::stderr_access);
+  std::cerr << caller << ": Warning: Peak memory usage " << inGigabytes(memoryUsage())
+            << " GB exceeds the budget of " << inGigabytes(parameters.memory_budget) << " GB" << std::endl;
+}
+
 struct MergeBuffer
 {
   typedef RLArray<BlockArray> buffer_type;
@@ -143,77 +163,247 @@ struct MergeBuffer
 
   MergeParameters parameters;
 
-  std::mutex               buffer_lock;
-  std::vector<buffer_type> merge_buffers;
+  /*
+    Merge buffer i is a slot holding a pointer to a buffer, or a null pointer if the
+    buffer is empty. Threads claim the slots with atomic operations.
+  */
+  std::vector<std::atomic<buffer_type*>> merge_buffers;
 
   std::mutex ra_lock;
   RankArray  ra;
-  size_type  ra_values, ra_bytes;
+  size_type  ra_values, ra_bytes, ra_in_memory;
+  bool       over_budget;
 
   size_type  size;
 
+  /*
+    Buffers going to disk are written by a background thread. The worker threads only
+    wait if the write queue is full.
+  */
+  std::mutex               queue_lock;
+  std::condition_variable  queue_full, queue_empty;
+  std::deque<buffer_type>  write_queue;
+  bool                     finished;
+  std::thread              writer;
+  size_type                next_dir;  // Used only by the writer.
+
+  // Statistics for the write queue.
+  size_type max_queue, stalls, file_merges, merge_bytes;
+  double    stall_seconds, write_seconds, merge_seconds;
+
   MergeBuffer(size_type _size, const MergeParameters& _parameters) :
     parameters(_parameters),
     merge_buffers(_parameters.merge_buffers),
-    ra_values(0), ra_bytes(0), size(_size)
+    ra_values(0), ra_bytes(0), ra_in_memory(0), over_budget(false), size(_size),
+    finished(false), next_dir(0),
+    max_queue(0), stalls(0), file_merges(0), merge_bytes(0), stall_seconds(0.0), write_seconds(0.0), merge_seconds(0.0)
   {
+    for(size_type i = 0; i < this->merge_buffers.size(); i++) { this->merge_buffers[i] = nullptr; }
+    this->writer = std::thread(&MergeBuffer::writeLoop, this);
   }
 
-  ~MergeBuffer() {}
+  ~MergeBuffer()
+  {
+    this->finish();
+    for(size_type i = 0; i < this->merge_buffers.size(); i++)
+    {
+      delete this->merge_buffers[i].exchange(nullptr);
+    }
+  }
 
+  /*
+    Adds the buffer to the rank array. The buffer is kept in memory if it fits within
+    the memory limit for the rank array. Otherwise it is added to the write queue.
+  */
   void write(buffer_type& buffer)
   {
     if(buffer.empty()) { return; }
 
-    std::string filename;
     size_type buffer_values = buffer.values(), buffer_bytes = buffer.bytes();
+    size_type buffer_memory = buffer.data.blocks() * BlockArray::BLOCK_SIZE;
+    {
+      std::lock_guard<std::mutex> lock(this->ra_lock);
+      if(this->ra_in_memory + buffer_memory <= this->parameters.ra_memory)
+      {
+        this->ra_in_memory += buffer_memory;
+        this->ra.buffers.push_back(buffer_type());
+        this->ra.buffers.back().swap(buffer);
+      }
+    }
+    if(buffer.empty()) { this->report(buffer_values, buffer_bytes, true); return; }
+
+    double start = readTimer();
+    std::unique_lock<std::mutex> lock(this->queue_lock);
+    if(this->write_queue.size() >= this->parameters.write_queue)
+    {
+      this->queue_empty.wait(lock, [this]() { return (this->write_queue.size() < this->parameters.write_queue); });
+      this->stalls++; this->stall_seconds += readTimer() - start;
+    }
+    this->write_queue.push_back(buffer_type());
+    this->write_queue.back().swap(buffer);
+    this->max_queue = std::max(this->max_queue, (size_type)(this->write_queue.size()));
+    this->queue_full.notify_one();
+  }
+
+  void writeLoop()
+  {
+    while(true)
+    {
+      buffer_type buffer;
+      {
+        std::unique_lock<std::mutex> lock(this->queue_lock);
+        this->queue_full.wait(lock, [this]() { return (this->finished || !(this->write_queue.empty())); });
+        if(this->write_queue.empty()) { return; }
+        buffer.swap(this->write_queue.front()); this->write_queue.pop_front();
+        this->queue_empty.notify_one();
+      }
+
+      double start = readTimer();
+      std::string filename;
+      size_type buffer_values = buffer.values(), buffer_bytes = buffer.bytes();
+      {
+        std::lock_guard<std::mutex> lock(this->ra_lock);
+        filename = tempFile(this->parameters.tempPrefix(buffer_bytes, this->next_dir));
+        this->ra.filenames.push_back(filename);
+        this->ra.run_counts.push_back(buffer.size());
+        this->ra.value_counts.push_back(buffer.values());
+        this->ra.file_codecs.push_back(buffer.codec);
+        this->ra.file_levels.push_back(0);
+        this->ra.file_samples.push_back(std::vector<RLSample>());
+        this->ra.file_samples.back().swap(buffer.samples);
+      }
+      buffer.write(filename); buffer.clear();
+      this->write_seconds += readTimer() - start;
+      this->report(buffer_values, buffer_bytes, false);
+      this->mergeFiles();
+    }
+  }
+
+  /*
+    Levelled merging of temporary files while the rank array is being built. Whenever a
+    level has fan_in files of similar size, they are merged into one file at the next
+    level, so each run is rewritten about log_{fan_in}(flushes) times. Used only by the
+    writer.
+  */
+  void mergeFiles()
+  {
+    while(true)
+    {
+      RankArray group;
+      {
+        std::lock_guard<std::mutex> lock(this->ra_lock);
+        size_type level = this->ra.fullLevel(this->parameters.fan_in);
+        if(level == ~(size_type)0) { return; }
+        this->ra.moveLevel(level, group);
+      }
+      this->mergeGroup(group);
+    }
+  }
+
+  /*
+    After the last flush, merges the smallest files so that at most fan_in files remain.
+    The smallest files are at the lowest levels, so this rewrites at most a small part
+    of the rank array. Not thread-safe.
+  */
+  void compactFiles()
+  {
+    if(this->ra.filenames.size() <= this->parameters.fan_in) { return; }
+    RankArray group;
+    this->ra.moveFiles(this->ra.filenames.size() + 1 - this->parameters.fan_in, group);
+    this->mergeGroup(group);
+  }
+
+  // Merges the files into a new file and moves it back to the rank array.
+  void mergeGroup(RankArray& group)
+  {
+    double start = readTimer();
+    size_type bytes = 0;
+    for(size_type i = 0; i < group.filenames.size(); i++)
+    {
+      std::ifstream in(group.filenames[i].c_str(), std::ios_base::binary);
+      bytes += fileSize(in);
+    }
+    std::string filename = tempFile(this->parameters.tempPrefix(bytes, this->next_dir));
+    group.merge(filename);
     {
       std::lock_guard<std::mutex> lock(this->ra_lock);
-      filename = tempFile(this->parameters.tempPrefix());
-      this->ra.filenames.push_back(filename);
-      this->ra.run_counts.push_back(buffer.size());
-      this->ra.value_counts.push_back(buffer.values());
+      group.moveFiles(1, this->ra);
     }
-    buffer.write(filename); buffer.clear();
+    this->file_merges++; this->merge_bytes += bytes; this->merge_seconds += readTimer() - start;
+  }
 
+  // Waits until the write queue is empty and stops the writer thread.
+  void finish()
+  {
+    {
+      std::lock_guard<std::mutex> lock(this->queue_lock);
+      this->finished = true;
+    }
+    this->queue_full.notify_one();
+    if(this->writer.joinable()) { this->writer.join(); }
+  }
+
+  void report(size_type buffer_values, size_type buffer_bytes, bool in_memory)
+  {
 #ifdef VERBOSE_STATUS_INFO
     double ra_done, ra_gb;
 #endif
+    bool warn = false;
     {
       std::lock_guard<std::mutex> lock(this->ra_lock);
       this->ra_values += buffer_values;
       this->ra_bytes += buffer_bytes + sizeof(size_type);
+      if(!(this->over_budget) && !withinBudget(this->parameters)) { this->over_budget = warn = true; }
 #ifdef VERBOSE_STATUS_INFO
       ra_done = (100.0 * this->ra_values) / this->size;
       ra_gb = inGigabytes(this->ra_bytes);
 #endif
     }
+    if(warn) { budgetWarning(this->parameters, "buildRA()"); }
 
 #ifdef VERBOSE_STATUS_INFO
     {
       std::lock_guard<std::mutex> lock(Parallel::stderr_access);
       std::cerr << "buildRA(): Thread " << std::this_thread::get_id()
-                << ": Added the values to the rank array" << std::endl;
+                << ": Added the values to the rank array" << (in_memory ? " (in memory)" : "") << std::endl;
       std::cerr << "buildRA(): " << ra_done << "% done; RA size " << ra_gb << " GB" << std::endl;
     }
 #endif
   }
 
+  /*
+    Merges all merge buffers, adds them to the rank array, and waits until all
+    temporary files have been written. Not thread-safe.
+  */
   void flush()
   {
-    for(size_type i = 1; i < this->merge_buffers.size(); i++)
+    buffer_type buffer;
+    for(size_type i = 0; i < this->merge_buffers.size(); i++)
     {
-      this->merge_buffers[i] = buffer_type(this->merge_buffers[i], this->merge_buffers[i - 1]);
+      buffer_type* ptr = this->merge_buffers[i].exchange(nullptr);
+      if(ptr != nullptr) { buffer = buffer_type(buffer, *ptr); delete ptr; }
     }
 #ifdef VERBOSE_STATUS_INFO
     {
       std::lock_guard<std::mutex> lock(Parallel::stderr_access);
-      std::cerr << "buildRA(): Flushing "
-                << this->merge_buffers[this->merge_buffers.size() - 1].values()
-                << " values to disk" << std::endl;
+      std::cerr << "buildRA(): Flushing " << buffer.values() << " values to the rank array" << std::endl;
+    }
+#endif
+    this->write(buffer);
+    this->finish();
+    this->compactFiles();
+
+#ifdef VERBOSE_STATUS_INFO
+    std::cerr << "buildRA(): Writer spent " << this->write_seconds << " seconds writing; max queue depth "
+              << this->max_queue << std::endl;
+    std::cerr << "buildRA(): Worker threads waited for the writer " << this->stalls << " times ("
+              << this->stall_seconds << " seconds)" << std::endl;
+    if(this->file_merges > 0)
+    {
+      std::cerr << "buildRA(): Merged temporary files " << this->file_merges << " times ("
+                << inGigabytes(this->merge_bytes) << " GB in " << this->merge_seconds << " seconds)" << std::endl;
     }
 #endif
-    this->write(this->merge_buffers[this->merge_buffers.size() - 1]);
   }
 };
 
@@ -233,27 +423,39 @@ mergeRA(MergeBuffer& mb, MergeBuffer::buffer_type& thread_buffer,
   }
 #endif
 
+  /*
+    Try to place the buffer into an empty slot. If the slot is full, take its contents,
+    merge them with the buffer, and continue to the next slot. If another thread empties
+    the slot between the two operations, try again.
+  */
+  MergeBuffer::buffer_type* buffer = new MergeBuffer::buffer_type;
+  buffer->swap(thread_buffer);
   for(size_type i = 0; i < mb.merge_buffers.size(); i++)
   {
-    bool done = false;
-    {
-      std::lock_guard<std::mutex> lock(mb.buffer_lock);
-      if(mb.merge_buffers[i].empty()) { thread_buffer.swap(mb.merge_buffers[i]); done = true; }
-      else { temp_buffer.swap(mb.merge_buffers[i]); }
-    }
-    if(done)
+    while(true)
     {
+      MergeBuffer::buffer_type* expected = nullptr;
+      if(mb.merge_buffers[i].compare_exchange_strong(expected, buffer))
+      {
 #ifdef VERBOSE_STATUS_INFO
-      std::lock_guard<std::mutex> lock(Parallel::stderr_access);
-      std::cerr << "buildRA(): Thread " << std::this_thread::get_id()
-                << ": Added the values to buffer " << i << std::endl;
+        std::lock_guard<std::mutex> lock(Parallel::stderr_access);
+        std::cerr << "buildRA(): Thread " << std::this_thread::get_id()
+                  << ": Added the values to buffer " << i << std::endl;
 #endif
-      return;
+        return;
+      }
+      MergeBuffer::buffer_type* other = mb.merge_buffers[i].exchange(nullptr);
+      if(other != nullptr)
+      {
+        *buffer = MergeBuffer::buffer_type(*buffer, *other);
+        delete other;
+        break;
+      }
     }
-    thread_buffer = MergeBuffer::buffer_type(thread_buffer, temp_buffer);
   }
 
-  mb.write(thread_buffer);
+  mb.write(*buffer);
+  delete buffer;
 }
 
 //------------------------------------------------------------------------------
@@ -269,68 +471,297 @@ struct MergePosition
   MergePosition(size_type pos, size_type sp, size_type ep) : a_pos(pos), b_range(sp, ep) {}
 };
 
+/*
+  Shared pool of pending merge positions. When a thread runs out of sequence blocks,
+  it waits in the pool. Busy threads check hungry() after each position and donate
+  the bottom half of their stacks, which contains the largest unexplored subtrees.
+  The threads finish when all of them are waiting and the pool is empty.
+*/
+struct PositionPool
+{
+  std::mutex                 mtx;
+  std::condition_variable    available;
+  std::vector<MergePosition> positions;
+  size_type                  threads, idle;
+  std::atomic<size_type>     waiting;
+  bool                       finished;
+
+  explicit PositionPool(size_type _threads) :
+    threads(_threads), idle(0), waiting(0), finished(false)
+  {
+  }
+
+  ~PositionPool()
+  {
+  }
+
+  inline bool hungry() const { return (this->waiting.load(std::memory_order_relaxed) > 0); }
+
+  void donate(std::vector<MergePosition>& stack)
+  {
+    size_type count = stack.size() / 2;
+    if(count == 0) { return; }
+    {
+      std::lock_guard<std::mutex> lock(this->mtx);
+      if(!(this->positions.empty())) { return; } // The waiting threads have not taken the last donation yet.
+      this->positions.insert(this->positions.end(), stack.begin(), stack.begin() + count);
+    }
+    stack.erase(stack.begin(), stack.begin() + count);
+    this->available.notify_all();
+  }
+
+  /*
+    Waits until there are positions in the pool and moves a share of them to the stack.
+    Returns false when there is no work left.
+  */
+  bool steal(std::vector<MergePosition>& stack)
+  {
+    std::unique_lock<std::mutex> lock(this->mtx);
+    this->idle++; this->waiting++;
+    if(this->idle >= this->threads && this->positions.empty())
+    {
+      this->finished = true; this->available.notify_all();
+    }
+    this->available.wait(lock, [this]() { return (this->finished || !(this->positions.empty())); });
+    this->waiting--;
+    if(this->positions.empty()) { return false; }
+    this->idle--;
+
+    size_type count = (this->positions.size() + this->waiting) / (this->waiting + 1);
+    stack.insert(stack.end(), this->positions.end() - count, this->positions.end());
+    this->positions.resize(this->positions.size() - count);
+    return true;
+  }
+};
+
+/*
+  Processes a batch of at most FMI::LF_BATCH positions. The BWT blocks needed by the
+  batch are found and prefetched before decoding any of them. Adds the runs to the
+  run buffer and calls output(c, position) for each extension by character c.
+*/
+template<class Output>
 void
-buildRA(ParallelLoop& loop, const FMI& a, const FMI& b, MergeBuffer& mb)
+extendBatch(const FMI& a, const FMI& b, const MergePosition* batch, size_type batch_size,
+  MergeBuffer& mb, MergeBuffer::buffer_type& thread_buffer, std::vector<MergeBuffer::run_type>& run_buffer,
+  Output output)
 {
-  while(true)
+  BWT::ranks_type a_pos, b_sp, b_ep;
+  BWT::rank_ranges_type b_range;
+  size_type a_blocks[FMI::LF_BATCH], b_blocks[FMI::LF_BATCH];
+
+  for(size_type i = 0; i < batch_size; i++)
   {
-    range_type sequence_range = loop.next();
-    if(Range::empty(sequence_range)) { return; }
+    a_blocks[i] = a.bwt.findBlock(batch[i].a_pos); a.bwt.prefetch(a_blocks[i]);
+    b_blocks[i] = b.bwt.findBlock(batch[i].b_range.first); b.bwt.prefetch(b_blocks[i]);
+  }
 
-    MergeBuffer::buffer_type thread_buffer;
-    std::vector<MergeBuffer::run_type> run_buffer; run_buffer.reserve(mb.parameters.run_buffer_size);
-    std::stack<MergePosition> positions;
-    BWT::ranks_type a_pos, b_sp, b_ep;
-    BWT::rank_ranges_type b_range;
+  for(size_type i = 0; i < batch_size; i++)
+  {
+    const MergePosition& curr = batch[i];
+    run_buffer.push_back(MergeBuffer::run_type(curr.a_pos, Range::length(curr.b_range)));
+    if(run_buffer.size() >= mb.parameters.run_buffer_size)
+    {
+      mergeRA(mb, thread_buffer, run_buffer, false);
+    }
 
-    positions.push(MergePosition(a.sequences(), sequence_range));
-    while(!(positions.empty()))
+    if(Range::length(curr.b_range) == 1)
     {
-      MergePosition curr = positions.top(); positions.pop();
-      run_buffer.push_back(MergeBuffer::run_type(curr.a_pos, Range::length(curr.b_range)));
-      if(run_buffer.size() >= mb.parameters.run_buffer_size)
+      range_type pred = b.blockLF(curr.b_range.first, b_blocks[i]);
+      if(pred.second != 0)
       {
-        mergeRA(mb, thread_buffer, run_buffer, false);
+        output(pred.second, MergePosition(a.blockLF(curr.a_pos, pred.second, a_blocks[i]), pred.first));
       }
-
-      if(Range::length(curr.b_range) == 1)
+    }
+    else if(Range::length(curr.b_range) <= FMI::SHORT_RANGE)
+    {
+      b.blockLF(curr.b_range, b_range, b_blocks[i]);
+      for(size_type c = 1; c < b.alpha.sigma; c++)
       {
-        range_type pred = b.LF(curr.b_range.first);
-        if(pred.second != 0)
+        if(!(Range::empty(b_range[c])))
         {
-          positions.push(MergePosition(a.LF(curr.a_pos, pred.second), pred.first));
+          output(c, MergePosition(a.blockLF(curr.a_pos, c, a_blocks[i]), b_range[c]));
         }
       }
-      else if(Range::length(curr.b_range) <= FMI::SHORT_RANGE)
+    }
+    else
+    {
+      a.blockLF(curr.a_pos, a_pos, a_blocks[i]); b.blockLF(curr.b_range, b_sp, b_ep, b_blocks[i]);
+      for(size_type c = 1; c < b.alpha.sigma; c++)
       {
-        b.LF(curr.b_range, b_range);
-        for(size_type c = 1; c < b.alpha.sigma; c++)
-        {
-          if(!(Range::empty(b_range[c])))
-          {
-            positions.push(MergePosition(a.LF(curr.a_pos, c), b_range[c]));
-          }
-        }
+        if(b_sp[c] <= b_ep[c]) { output(c, MergePosition(a_pos[c], b_sp[c], b_ep[c])); }
       }
-      else
+    }
+  }
+}
+
+void
+buildRA(ParallelLoop& loop, const FMI& a, const FMI& b, MergeBuffer& mb, PositionPool& pool)
+{
+  MergeBuffer::buffer_type thread_buffer;
+  std::vector<MergeBuffer::run_type> run_buffer; run_buffer.reserve(mb.parameters.run_buffer_size);
+  std::vector<MergePosition> positions;
+  range_type sequence_range = Range::empty_range();
+  MergePosition batch[FMI::LF_BATCH];
+  auto push = [&positions](size_type, const MergePosition& pos) { positions.push_back(pos); };
+
+  while(true)
+  {
+    if(positions.empty())
+    {
+#ifdef VERBOSE_STATUS_INFO
+      if(!(Range::empty(sequence_range)))
       {
-        a.LF(curr.a_pos, a_pos); b.LF(curr.b_range, b_sp, b_ep);
-        for(size_type c = 1; c < b.alpha.sigma; c++)
-        {
-          if(b_sp[c] <= b_ep[c]) { positions.push(MergePosition(a_pos[c], b_sp[c], b_ep[c])); }
-        }
+        std::lock_guard<std::mutex> lock(Parallel::stderr_access);
+        std::cerr << "buildRA(): Thread " << std::this_thread::get_id() << ": Finished block "
+                  << sequence_range << std::endl;
       }
+#endif
+      sequence_range = loop.next();
+      if(!(Range::empty(sequence_range))) { positions.push_back(MergePosition(a.sequences(), sequence_range)); }
+      else if(!(pool.steal(positions))) { break; }
     }
 
-    mergeRA(mb, thread_buffer, run_buffer, true);
-  #ifdef VERBOSE_STATUS_INFO
+    size_type batch_size = std::min((size_type)(positions.size()), FMI::LF_BATCH);
+    for(size_type i = 0; i < batch_size; i++) { batch[i] = positions.back(); positions.pop_back(); }
+    extendBatch(a, b, batch, batch_size, mb, thread_buffer, run_buffer, push);
+
+    if(pool.hungry()) { pool.donate(positions); }
+  }
+
+  mergeRA(mb, thread_buffer, run_buffer, true);
+}
+
+/*
+  Level-synchronous traversal. Each sequence block is processed one backward step at
+  a time. Because LF(i, c) is monotone in i, extending a level sorted by a_pos and
+  bucketing the extensions by character gives the next level in sorted order without
+  sorting. Consecutive queries hit nearby BWT blocks. The run buffer still spans many
+  short levels, so it is radix sorted as usual. There is no work stealing in this mode.
+*/
+void
+buildRALevels(ParallelLoop& loop, const FMI& a, const FMI& b, MergeBuffer& mb)
+{
+  MergeBuffer::buffer_type thread_buffer;
+  std::vector<MergeBuffer::run_type> run_buffer; run_buffer.reserve(mb.parameters.run_buffer_size);
+  std::vector<MergePosition> level;
+  std::vector<std::vector<MergePosition>> buckets(b.alpha.sigma);
+  auto push = [&buckets](size_type c, const MergePosition& pos) { buckets[c].push_back(pos); };
+
+  while(true)
+  {
+    range_type sequence_range = loop.next();
+    if(Range::empty(sequence_range)) { break; }
+    level.clear(); level.push_back(MergePosition(a.sequences(), sequence_range));
+
+    while(!(level.empty()))
     {
-      std::lock_guard<std::mutex> lock(Parallel::stderr_access);
-      std::cerr << "buildRA(): Thread " << std::this_thread::get_id() << ": Finished block "
-                << sequence_range << std::endl;
+      for(size_type i = 0; i < level.size(); i += FMI::LF_BATCH)
+      {
+        size_type batch_size = std::min((size_type)(level.size() - i), FMI::LF_BATCH);
+        extendBatch(a, b, level.data() + i, batch_size, mb, thread_buffer, run_buffer, push);
+      }
+      level.clear();
+      for(size_type c = 1; c < buckets.size(); c++)
+      {
+        level.insert(level.end(), buckets[c].begin(), buckets[c].end()); buckets[c].clear();
+      }
+    }
+
+#ifdef VERBOSE_STATUS_INFO
+    std::lock_guard<std::mutex> lock(Parallel::stderr_access);
+    std::cerr << "buildRA(): Thread " << std::this_thread::get_id() << ": Finished block "
+              << sequence_range << std::endl;
+#endif
+  }
+
+  mergeRA(mb, thread_buffer, run_buffer, true);
+}
+
+/*
+  Walks backward from the end-marker of the middle sequence of each stratum until the
+  start of the sequence or until limit steps, and stores the number of steps.
+*/
+void
+sampleLengths(ParallelLoop& loop, const FMI& b, const std::vector<range_type>& strata,
+  size_type limit, std::vector<size_type>& lengths)
+{
+  while(true)
+  {
+    range_type range = loop.next();
+    if(Range::empty(range)) { return; }
+
+    for(size_type i = range.first; i <= range.second; i++)
+    {
+      size_type pos = strata[i].first + Range::length(strata[i]) / 2, length = 1;
+      while(length < limit)
+      {
+        range_type pred = b.LF(pos);
+        if(pred.second == 0) { break; }
+        pos = pred.first; length++;
+      }
+      lengths[i] = length;
+    }
+  }
+}
+
+/*
+  Partitions the sequences of b into blocks of roughly equal estimated work. The
+  sequences are split into BLOCK_SAMPLES strata per block, and every sequence in a
+  stratum is assumed to be as long as the sampled one. Sampling is skipped with a
+  single thread, where the blocks are only used for status information.
+*/
+std::vector<range_type>
+sequenceBlocks(const FMI& b, const MergeParameters& parameters)
+{
+  if(b.sequences() == 0) { return std::vector<range_type>(); }
+  range_type sequences(0, b.sequences() - 1);
+  size_type block_count = parameters.sequence_blocks;
+  if(block_count <= 1 || parameters.threads <= 1) { return getBounds(sequences, block_count); }
+
+#ifdef VERBOSE_STATUS_INFO
+  double start = readTimer();
+#endif
+
+  std::vector<range_type> strata = getBounds(sequences, block_count * FMI::BLOCK_SAMPLES);
+  std::vector<size_type> lengths(strata.size(), 1);
+  size_type limit = std::max(FMI::SAMPLE_LIMIT * std::max(b.size() / b.sequences(), (size_type)1),
+    b.size() / (FMI::SAMPLE_FRACTION * strata.size()));
+  {
+    ParallelLoop loop(0, strata.size(), block_count, parameters.threads);
+    loop.execute(sampleLengths, std::ref(b), std::ref(strata), limit, std::ref(lengths));
+  }
+
+  double total = 0.0;
+  for(size_type i = 0; i < strata.size(); i++) { total += Range::length(strata[i]) * (double)(lengths[i]); }
+
+  std::vector<range_type> blocks;
+  double target = total / block_count, done = 0.0;
+  size_type block_start = 0;
+  for(size_type i = 0; i < strata.size() && blocks.size() + 1 < block_count; i++)
+  {
+    size_type pos = strata[i].first;
+    while(pos <= strata[i].second && blocks.size() + 1 < block_count)
+    {
+      double needed = target * (blocks.size() + 1) - done;
+      size_type count = (needed <= lengths[i] ? 1 : std::ceil(needed / lengths[i]));
+      count = std::min(count, strata[i].second + 1 - pos);
+      done += count * (double)(lengths[i]); pos += count;
+      if(done >= target * (blocks.size() + 1))
+      {
+        blocks.push_back(range_type(block_start, pos - 1)); block_start = pos;
+      }
     }
-  #endif
   }
+  if(block_start <= sequences.second) { blocks.push_back(range_type(block_start, sequences.second)); }
+
+#ifdef VERBOSE_STATUS_INFO
+  double seconds = readTimer() - start;
+  std::cerr << "bwt_merge: Sampled " << strata.size() << " sequence lengths in " << seconds << " seconds" << std::endl;
+  std::cerr << "bwt_merge: Estimated " << (total / b.sequences()) << " bases / sequence in "
+            << blocks.size() << " blocks" << std::endl;
+#endif
+
+  return blocks;
 }
 
 FMI::FMI(FMI& a, FMI& b, MergeParameters parameters)
@@ -348,12 +779,20 @@ FMI::FMI(FMI& a, FMI& b, MergeParameters parameters)
   double start = readTimer();
 #endif
 
-  std::vector<range_type> bounds = getBounds(range_type(0, b.sequences() - 1), parameters.sequence_blocks);
+  std::vector<range_type> blocks = sequenceBlocks(b, parameters);
 
   MergeBuffer mb(b.size(), parameters);
   {
-    ParallelLoop loop(0, b.sequences(), parameters.sequence_blocks, parameters.threads);
-    loop.execute(buildRA, std::ref(a), std::ref(b), std::ref(mb));
+    ParallelLoop loop(blocks, parameters.threads, true);
+    if(parameters.level_order)
+    {
+      loop.execute(buildRALevels, std::ref(a), std::ref(b), std::ref(mb));
+    }
+    else
+    {
+      PositionPool pool(loop.threads.size());
+      loop.execute(buildRA, std::ref(a), std::ref(b), std::ref(mb), std::ref(pool));
+    }
   }
   mb.flush();
 
@@ -363,7 +802,8 @@ FMI::FMI(FMI& a, FMI& b, MergeParameters parameters)
   std::cerr << "bwt_merge: Memory usage with RA: " << inGigabytes(memoryUsage()) << " GB" << std::endl;
 #endif
 
-  this->bwt = BWT(a.bwt, b.bwt, mb.ra);
+  this->bwt = BWT(a.bwt, b.bwt, mb.ra, parameters.merge_chunks);
+  if(!(mb.over_budget) && !withinBudget(parameters)) { budgetWarning(parameters, "FMI::FMI()"); }
   this->alpha = a.alpha;
   for(size_type c = 0; c <= this->alpha.sigma; c++) { this->alpha.C[c] += b.alpha.C[c]; }
 }
@@ -453,9 +893,9 @@ const std::string MergeParameters::TEMP_FILE_PREFIX = ".bwtmerge";
 
 MergeParameters::MergeParameters() :
   run_buffer_size(RUN_BUFFER_SIZE), thread_buffer_size(THREAD_BUFFER_SIZE),
-  merge_buffers(MERGE_BUFFERS),
+  merge_buffers(MERGE_BUFFERS), ra_memory(RA_MEMORY), write_queue(WRITE_QUEUE), fan_in(FAN_IN),
   threads(Parallel::max_threads), sequence_blocks(threads * BLOCKS_PER_THREAD),
-  temp_dir(DEFAULT_TEMP_DIR)
+  level_order(false), memory_budget(0), merge_chunks(0), temp_dirs(1, DEFAULT_TEMP_DIR)
 {
 }
 
@@ -465,32 +905,138 @@ MergeParameters::sanitize()
   this->threads = Range::bound(this->threads, 1, Parallel::max_threads);
   this->sequence_blocks = std::max(this->sequence_blocks, (size_type)1);
   this->threads = std::min(this->threads, this->sequence_blocks);
+  this->write_queue = std::max(this->write_queue, (size_type)1);
+  this->fan_in = std::max(this->fan_in, (size_type)2);
+  if(this->memory_budget > 0)
+  {
+    BlockPool::max_retained = std::min(BlockPool::max_retained, this->memory_budget / BUDGET_POOL);
+  }
 }
 
 void
-MergeParameters::setTemp(const std::string& directory)
+MergeParameters::setTemp(const std::string& directories)
 {
-  if(directory.length() == 0) { this->temp_dir = DEFAULT_TEMP_DIR; }
-  else if(directory[directory.length() - 1] != '/') { this->temp_dir = directory; }
-  else { this->temp_dir = directory.substr(0, directory.length() - 1); }
+  std::vector<std::string> tokens;
+  tokenize(directories, tokens, ',');
+
+  this->temp_dirs.clear();
+  for(size_type i = 0; i < tokens.size(); i++)
+  {
+    const std::string& directory = tokens[i];
+    if(directory.length() == 0) { continue; }
+    else if(directory[directory.length() - 1] != '/') { this->temp_dirs.push_back(directory); }
+    else { this->temp_dirs.push_back(directory.substr(0, directory.length() - 1)); }
+  }
+  if(this->temp_dirs.empty()) { this->temp_dirs.push_back(DEFAULT_TEMP_DIR); }
+}
+
+size_type
+MergeParameters::bufferMemory() const
+{
+  size_type run_bytes = this->run_buffer_size * sizeof(run_type);
+  size_type thread_bytes = blockBytes(this->thread_buffer_size);
+  size_type flush_bytes = blockBytes(this->thread_buffer_size << this->merge_buffers);
+  return this->threads * (run_bytes + 2 * thread_bytes)
+    + (this->write_queue + 3) * flush_bytes + this->ra_memory;
+}
+
+bool
+MergeParameters::fitBudget(size_type input_bytes)
+{
+  if(this->memory_budget == 0) { return true; }
+
+  /*
+    The final merge needs the inputs, the output, the in-memory rank array, and at least
+    one interleaved chunk. A chunk cannot be much larger than the inputs.
+  */
+  size_type reserve = this->memory_budget / BUDGET_RESERVE + BlockPool::max_retained;
+  if(this->memory_budget < reserve) { return false; }
+  size_type final_memory = reserve + 2 * input_bytes + this->ra_memory;
+  size_type chunk_memory = std::min((size_type)(BWT::CHUNK_MEMORY), std::max(input_bytes, (size_type)1));
+  if(this->memory_budget < final_memory + chunk_memory) { return false; }
+  this->merge_chunks = std::min(2 * this->threads + 1, (this->memory_budget - final_memory) / chunk_memory);
+  size_type available = this->memory_budget - reserve - input_bytes - this->ra_memory;
+
+  /*
+    Per-thread share: run buffer (half a thread buffer) plus two thread buffers. The
+    shared buffers need write_queue + 3 thread buffers even without merge buffers. The
+    thread buffers are whole BlockArray blocks, so the estimates are exact.
+  */
+  size_type thread_buffer = 0;
+  while(true)
+  {
+    size_type base = 5 * this->threads + 2 * (this->write_queue + 3); // Half thread buffers.
+    thread_buffer = std::min({ (size_type)THREAD_BUFFER_SIZE, available / (5 * this->threads), 2 * available / base });
+    thread_buffer -= thread_buffer % BlockArray::BLOCK_SIZE;
+    if(thread_buffer >= MIN_THREAD_BUFFER || this->threads <= 1) { break; }
+    this->threads--;
+  }
+  if(thread_buffer < MIN_THREAD_BUFFER) { return false; }
+  this->thread_buffer_size = thread_buffer;
+  this->run_buffer_size = thread_buffer / 2 / sizeof(run_type);
+
+  // The merge buffers get the rest.
+  size_type shared = available - this->threads * (thread_buffer / 2 + 2 * thread_buffer);
+  this->merge_buffers = 0;
+  while(this->merge_buffers < MAX_MERGE_BUFFERS &&
+    (this->write_queue + 3) * (thread_buffer << (this->merge_buffers + 1)) <= shared)
+  {
+    this->merge_buffers++;
+  }
+
+  return (reserve + input_bytes + this->bufferMemory() <= this->memory_budget);
 }
 
 std::string
-MergeParameters::tempPrefix() const
+MergeParameters::tempPrefix(size_type bytes, size_type& next_dir) const
 {
-  return this->temp_dir + '/' + TEMP_FILE_PREFIX;
+  size_type dir = next_dir % this->temp_dirs.size();
+  if(this->temp_dirs.size() > 1)
+  {
+    size_type best = dir, best_space = 0;
+    for(size_type i = 0; i < this->temp_dirs.size(); i++)
+    {
+      size_type candidate = (next_dir + i) % this->temp_dirs.size();
+      size_type space = freeSpace(this->temp_dirs[candidate]);
+      if(space >= bytes) { best = candidate; break; }
+      if(space > best_space) { best = candidate; best_space = space; }
+    }
+    dir = best;
+  }
+  next_dir = dir + 1;
+  return this->temp_dirs[dir] + '/' + TEMP_FILE_PREFIX;
 }
 
 std::ostream&
 operator<< (std::ostream& stream, const MergeParameters& parameters)
 {
-  stream << "Run buffers:      "
-    << inMegabytes(parameters.run_buffer_size * sizeof(MergeParameters::run_type)) << " MB" << std::endl;
-  stream << "Thread buffers:   " << inMegabytes(parameters.thread_buffer_size) << " MB" << std::endl;
-  stream << "Merge buffers:    " << parameters.merge_buffers << std::endl;
+  if(parameters.memory_budget > 0)
+  {
+    stream << "Buffers:          derived from the memory budget" << std::endl;
+  }
+  else
+  {
+    stream << "Run buffers:      "
+      << inMegabytes(parameters.run_buffer_size * sizeof(MergeParameters::run_type)) << " MB" << std::endl;
+    stream << "Thread buffers:   " << inMegabytes(parameters.thread_buffer_size) << " MB" << std::endl;
+    stream << "Merge buffers:    " << parameters.merge_buffers << std::endl;
+  }
+  stream << "RA memory:        " << inMegabytes(parameters.ra_memory) << " MB" << std::endl;
+  stream << "Write queue:      " << parameters.write_queue << std::endl;
+  stream << "Fan-in:           " << parameters.fan_in << " files" << std::endl;
+  stream << "Memory budget:    ";
+  if(parameters.memory_budget > 0) { stream << inGigabytes(parameters.memory_budget) << " GB" << std::endl; }
+  else { stream << "none" << std::endl; }
   stream << "Threads:          " << parameters.threads << std::endl;
   stream << "Sequence blocks:  " << parameters.sequence_blocks << std::endl;
-  stream << "Temp directory:   " << parameters.temp_dir << std::endl;
+  stream << "Traversal:        " << (parameters.level_order ? "level order" : "depth-first") << std::endl;
+  stream << "Temp directories: ";
+  for(size_type i = 0; i < parameters.temp_dirs.size(); i++)
+  {
+    if(i > 0) { stream << ", "; }
+    stream << parameters.temp_dirs[i];
+  }
+  stream << std::endl;
   return stream;
 }
 
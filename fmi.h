@@ -49,7 +49,16 @@ struct MergeParameters
   const static size_type RUN_BUFFER_SIZE = 8 * MEGABYTE;      // Runs.
   const static size_type THREAD_BUFFER_SIZE = 256 * MEGABYTE; // Bytes.
   const static size_type MERGE_BUFFERS = 6;
-  const static size_type BLOCKS_PER_THREAD = 4;
+  const static size_type RA_MEMORY = 0;                       // Bytes.
+  const static size_type WRITE_QUEUE = 2;                     // Buffers.
+  const static size_type FAN_IN = 256;                        // Files.
+  const static size_type BLOCKS_PER_THREAD = 16;
+
+  // Limits for the buffer sizes derived from a memory budget.
+  const static size_type MIN_THREAD_BUFFER = BlockArray::BLOCK_SIZE; // Bytes.
+  const static size_type MAX_MERGE_BUFFERS = 16;
+  const static size_type BUDGET_RESERVE = 16;                 // Keep 1/16 of the budget in reserve.
+  const static size_type BUDGET_POOL = 16;                    // The block pool may retain 1/16 of the budget.
 
   const static std::string DEFAULT_TEMP_DIR;  // .
   const static std::string TEMP_FILE_PREFIX;  // .bwtmerge
@@ -61,22 +70,75 @@ struct MergeParameters
   inline static double defaultRB() { return inMegabytes(RUN_BUFFER_SIZE * sizeof(run_type)); }
   inline static double defaultTB() { return inMegabytes(THREAD_BUFFER_SIZE); }
   inline static size_type defaultMB() { return MERGE_BUFFERS; }
+  inline static double defaultRM() { return inMegabytes(RA_MEMORY); }
+  inline static size_type defaultWQ() { return WRITE_QUEUE; }
+  inline static size_type defaultFI() { return FAN_IN; }
   inline static size_type defaultT()  { return Parallel::max_threads; }
   inline static size_type defaultSB() { return BLOCKS_PER_THREAD; }
 
   inline void setRB(size_type mb) { this->run_buffer_size = mb * MEGABYTE / sizeof(run_type); }
   inline void setTB(size_type mb) { this->thread_buffer_size = mb * MEGABYTE; }
   inline void setMB(size_type n)  { this->merge_buffers = n; }
+  inline void setRM(size_type mb) { this->ra_memory = mb * MEGABYTE; }
+  inline void setWQ(size_type n)  { this->write_queue = n; }
+  inline void setFI(size_type n)  { this->fan_in = n; }
   inline void setT(size_type n)   { this->threads = n; }
   inline void setSB(size_type n)  { this->sequence_blocks = n; }
+  inline void setLevelOrder(bool level_order) { this->level_order = level_order; }
+  inline void setMemory(double gb) { this->memory_budget = gb * GIGABYTE_DOUBLE; }
+
+  /*
+    Estimated peak memory usage of the rank array buffers and the in-memory rank array
+    in bytes. Each thread has a run buffer and a thread buffer, which temporarily exists
+    twice while it is being merged. The merge buffers hold up to 2^merge_buffers thread
+    buffers, and the write queue, the writer, and a thread merging the buffers may each
+    hold one more buffer of the same size. The buffers are RLArray<BlockArray>, so they
+    take whole BlockArray blocks.
+  */
+  size_type bufferMemory() const;
 
-  void setTemp(const std::string& directory);
-  std::string tempPrefix() const;
+  // Rounds the size of a buffer up to whole BlockArray blocks.
+  inline static size_type blockBytes(size_type bytes)
+  {
+    return ((bytes + BlockArray::BLOCK_SIZE - 1) / BlockArray::BLOCK_SIZE) * BlockArray::BLOCK_SIZE;
+  }
+
+  /*
+    Derives the sizes of the run buffers, thread buffers, and merge buffers from the
+    memory budget, given the memory usage of the loaded input BWTs in bytes (see
+    FMI::memoryBytes()). The output is assumed to be as large as the inputs. Half of the
+    memory left after the inputs and the in-memory rank array goes to thread-specific
+    buffers and half to the merge buffers, but the shared buffers always get room for
+    write_queue + 3 thread buffers. If the thread buffers would be too small, the number
+    of threads is reduced. The memory retained by the block pool is not available for
+    the buffers; sanitize() limits it to 1/BUDGET_POOL of the budget. The number of
+    interleaved chunks in the final merge is limited by the memory left after two copies
+    of the inputs. Returns false if the budget cannot fit the merge. Does nothing if
+    there is no budget.
+  */
+  bool fitBudget(size_type input_bytes);
+
+  // Sets the temporary directories from a comma-separated list.
+  void setTemp(const std::string& directories);
+
+  /*
+    Returns the prefix for a temporary file of the given size. The directories are used
+    in round-robin order, skipping those that do not have enough free space. If no
+    directory has enough space, the one with the most free space is used. Updates
+    next_dir to the directory after the chosen one.
+  */
+  std::string tempPrefix(size_type bytes, size_type& next_dir) const;
 
   size_type run_buffer_size, thread_buffer_size;
   size_type merge_buffers;
+  size_type ra_memory;    // Keep up to this many bytes of the rank array in memory.
+  size_type write_queue;  // Maximum number of buffers waiting to be written to disk.
+  size_type fan_in;       // Maximum number of temporary files merged at once.
   size_type threads, sequence_blocks;
-  std::string temp_dir;
+  bool level_order;       // Build the rank array in level order instead of depth-first order.
+  size_type memory_budget;  // Derive the buffer sizes from this many bytes (0 = no budget).
+  size_type merge_chunks;   // Interleaved chunks in memory in the final merge (0 = 2 * threads + 1).
+  std::vector<std::string> temp_dirs;
 };
 
 std::ostream& operator<< (std::ostream& stream, const MergeParameters& parameters);
@@ -89,6 +151,12 @@ public:
   typedef BWT::size_type size_type;
 
   const static size_type SHORT_RANGE = 256; // Compute LF(range) by a linear scan of the BWT.
+  const static size_type LF_BATCH    = 16;  // Merge positions processed together in buildRA().
+
+  // Sequence lengths are sampled for partitioning the sequences into blocks.
+  const static size_type BLOCK_SAMPLES   = 16; // Samples per sequence block.
+  const static size_type SAMPLE_FRACTION = 16; // Sample at most 1/16 of the bases in total...
+  const static size_type SAMPLE_LIMIT    = 4;  // ...but allow 4x the average length per sample.
 
   FMI();
   FMI(const FMI& source);
@@ -136,6 +204,9 @@ public:
 //------------------------------------------------------------------------------
 
   inline size_type size() const { return this->bwt.size(); }
+
+  // Memory usage in bytes, including the parts that are not serialized.
+  inline size_type memoryBytes() const { return sdsl::size_in_bytes(*this) + this->bwt.headerBytes(); }
   inline size_type sequences() const { return this->bwt.sequences(); }
 
   inline range_type charRange(comp_type comp) const
@@ -192,6 +263,45 @@ public:
     }
   }
 
+  /*
+    Versions of LF() for batched queries, where block = bwt.findBlock(i) (or
+    bwt.findBlock(range.first)) has been computed and prefetched in advance.
+  */
+  inline range_type blockLF(size_type i, size_type block) const
+  {
+    range_type temp = this->bwt.inverse_select(i, block);
+    return range_type(temp.first + this->alpha.C[temp.second], temp.second);
+  }
+
+  inline size_type blockLF(size_type i, comp_type comp, size_type block) const
+  {
+    return this->alpha.C[comp] + this->bwt.rank(i, comp, block);
+  }
+
+  inline void blockLF(size_type i, BWT::ranks_type& results, size_type block) const
+  {
+    this->bwt.ranks(i, results, block);
+    for(size_type c = 1; c < this->alpha.sigma; c++) { results[c] += this->alpha.C[c]; }
+  }
+
+  inline void blockLF(range_type range, BWT::ranks_type& sp, BWT::ranks_type& ep, size_type block) const
+  {
+    this->bwt.ranks(range.first, sp, block); this->bwt.ranks(range.second + 1, ep);
+    for(size_type c = 1; c < this->alpha.sigma; c++)
+    {
+      sp[c] += this->alpha.C[c]; ep[c] += this->alpha.C[c] - 1;
+    }
+  }
+
+  inline void blockLF(range_type range, BWT::rank_ranges_type& results, size_type block) const
+  {
+    this->bwt.ranks(range, results, block);
+    for(size_type c = 1; c < this->alpha.sigma; c++)
+    {
+      results[c].first += this->alpha.C[c]; results[c].second += this->alpha.C[c] - 1;
+    }
+  }
+
   template<class Iterator>
   range_type find(Iterator begin, Iterator end) const
   {
@@ -526,10 +526,28 @@ NativeHeader::setOrder(AlphabeticOrder ao)
   this->flags |= static_cast<uint32_t>(ao) & ALPHABET_MASK;
 }
 
+size_type
+NativeHeader::blockSize() const
+{
+  size_type log_size = (this->flags & BLOCK_SIZE_MASK) >> BLOCK_SIZE_SHIFT;
+  return (log_size == 0 ? DEFAULT_BLOCK_SIZE : (size_type)1 << log_size);
+}
+
+void
+NativeHeader::setBlockSize(size_type block_size)
+{
+  this->flags &= ~BLOCK_SIZE_MASK;
+  if(block_size != DEFAULT_BLOCK_SIZE)
+  {
+    this->flags |= ((bit_length(block_size) - 1) << BLOCK_SIZE_SHIFT) & BLOCK_SIZE_MASK;
+  }
+}
+
 std::ostream& operator<<(std::ostream& stream, const NativeHeader& header)
 {
   return stream << NativeFormat::name << ": " << header.sequences << " sequences, "
-                << header.bases << " bases, " << alphabetName(header.order()) << " alphabet";
+                << header.bases << " bases, " << alphabetName(header.order()) << " alphabet, "
+                << header.blockSize() << "-byte blocks";
 }
 
 //------------------------------------------------------------------------------
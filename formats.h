@@ -50,6 +50,10 @@ struct NativeHeader
 
   const static uint32_t DEFAULT_TAG = 0x54574221;
   const static uint32_t ALPHABET_MASK = 0xFF;
+  const static uint32_t BLOCK_DIRECTORY = 0x100;  // Block directory instead of sd_vector block boundaries.
+  const static uint32_t BLOCK_SIZE_MASK = 0xF000; // log2 of the BWT block size; 0 means 64 bytes.
+  const static uint32_t BLOCK_SIZE_SHIFT = 12;
+  const static size_type DEFAULT_BLOCK_SIZE = 64;
 
   NativeHeader();
 
@@ -59,6 +63,12 @@ struct NativeHeader
 
   AlphabeticOrder order() const;
   void setOrder(AlphabeticOrder ao);
+
+  size_type blockSize() const;
+  void setBlockSize(size_type block_size);
+
+  inline bool get(uint32_t flag) const { return (this->flags & flag); }
+  inline void set(uint32_t flag) { this->flags |= flag; }
 };
 
 std::ostream& operator<<(std::ostream& stream, const NativeHeader& header);
@@ -23,7 +23,15 @@
 */
 
 #include <cstring>
+#include <fcntl.h>
 #include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#if defined(__GNUC__) && defined(__x86_64__)
+#define BWTMERGE_X86_KERNELS
+#include <immintrin.h>
+#endif
 
 #include "support.h"
 
@@ -337,20 +345,487 @@ BlockArray::clear()
 void
 BlockArray::allocateBlock()
 {
-  value_type* ptr = (value_type*)mmap(0, BLOCK_SIZE, PROT_READ | PROT_WRITE, MAP_ANON | MAP_PRIVATE, -1, 0);
-  this->data.push_back(ptr);
+  this->data.push_back(BlockPool::allocate());
+}
+
+void
+BlockArray::append(const value_type* source, size_type n)
+{
+  while(n > 0)
+  {
+    if(offset(this->bytes) == 0) { this->allocateBlock(); }
+    size_type length = std::min(n, BLOCK_SIZE - offset(this->bytes));
+    std::memcpy((void*)(this->data[block(this->bytes)] + offset(this->bytes)), (const void*)source, length);
+    this->bytes += length; source += length; n -= length;
+  }
 }
 
 void
 BlockArray::clear(size_type _block)
 {
   if(this->data[_block] == 0) { return; }
-  munmap((void*)(this->data[_block]), BLOCK_SIZE);
+  size_type start = _block * BLOCK_SIZE;
+  size_type used = (this->bytes > start ? std::min(this->bytes - start, (size_type)BLOCK_SIZE) : 0);
+  BlockPool::release(this->data[_block], used);
   this->data[_block] = 0;
 }
 
 //------------------------------------------------------------------------------
 
+size_type BlockPool::max_retained = BlockPool::MAX_RETAINED;
+
+std::atomic<size_type> BlockPool::hits(0);
+std::atomic<size_type> BlockPool::misses(0);
+std::atomic<size_type> BlockPool::in_use(0);
+std::atomic<size_type> BlockPool::peak_in_use(0);
+std::atomic<size_type> BlockPool::retained(0);
+
+bool BlockPool::huge_pages = false;
+std::atomic<size_type> BlockPool::hugetlb_blocks(0);
+std::atomic<size_type> BlockPool::advised_blocks(0);
+std::atomic<bool>      hugetlb_failed(false);
+
+std::mutex                          shared_blocks_lock;
+std::vector<BlockPool::value_type*> shared_blocks;
+
+/*
+  The cache returns its blocks to the shared list when the thread exits.
+*/
+struct BlockCache
+{
+  std::vector<BlockPool::value_type*> blocks;
+
+  ~BlockCache()
+  {
+    std::lock_guard<std::mutex> lock(shared_blocks_lock);
+    shared_blocks.insert(shared_blocks.end(), this->blocks.begin(), this->blocks.end());
+  }
+};
+
+thread_local BlockCache block_cache;
+
+BlockPool::value_type*
+mapBlock(size_type bytes)
+{
+  return (BlockPool::value_type*)mmap(0, bytes, PROT_READ | PROT_WRITE, MAP_ANON | MAP_PRIVATE, -1, 0);
+}
+
+BlockPool::value_type*
+mapHuge()
+{
+#ifdef MAP_HUGETLB
+  if(!hugetlb_failed)
+  {
+    int flags = MAP_ANON | MAP_PRIVATE | MAP_HUGETLB;
+#ifdef MAP_HUGE_2MB
+    flags |= MAP_HUGE_2MB;
+#endif
+    void* ptr = mmap(0, BlockArray::BLOCK_SIZE, PROT_READ | PROT_WRITE, flags, -1, 0);
+    if(ptr != MAP_FAILED) { BlockPool::hugetlb_blocks++; return (BlockPool::value_type*)ptr; }
+    hugetlb_failed = true;
+  }
+#endif
+
+  // Map an extra huge page and trim the ends to align the block.
+  size_type bytes = BlockArray::BLOCK_SIZE + BlockPool::HUGE_PAGE_SIZE;
+  BlockPool::value_type* ptr = mapBlock(bytes);
+  if(ptr == (BlockPool::value_type*)MAP_FAILED) { return mapBlock(BlockArray::BLOCK_SIZE); }
+  size_type head = (BlockPool::HUGE_PAGE_SIZE - ((size_type)ptr) % BlockPool::HUGE_PAGE_SIZE) % BlockPool::HUGE_PAGE_SIZE;
+  size_type tail = BlockPool::HUGE_PAGE_SIZE - head;
+  if(head > 0) { munmap((void*)ptr, head); }
+  if(tail > 0) { munmap((void*)(ptr + head + BlockArray::BLOCK_SIZE), tail); }
+  ptr += head;
+#ifdef MADV_HUGEPAGE
+  if(madvise((void*)ptr, BlockArray::BLOCK_SIZE, MADV_HUGEPAGE) == 0) { BlockPool::advised_blocks++; }
+#endif
+  return ptr;
+}
+
+size_type
+BlockPool::transparentHugePages()
+{
+  std::ifstream in("/proc/self/smaps_rollup");
+  std::string line;
+  while(std::getline(in, line))
+  {
+    if(line.compare(0, 14, "AnonHugePages:") == 0)
+    {
+      return KILOBYTE * std::stoul(line.substr(14));
+    }
+  }
+  return 0;
+}
+
+BlockPool::value_type*
+BlockPool::allocate()
+{
+  value_type* block = nullptr;
+  if(!(block_cache.blocks.empty()))
+  {
+    block = block_cache.blocks.back(); block_cache.blocks.pop_back();
+  }
+  else
+  {
+    std::lock_guard<std::mutex> lock(shared_blocks_lock);
+    if(!(shared_blocks.empty())) { block = shared_blocks.back(); shared_blocks.pop_back(); }
+  }
+
+  if(block != nullptr) { retained--; hits++; }
+  else
+  {
+    block = (huge_pages ? mapHuge() : mapBlock(BlockArray::BLOCK_SIZE));
+    misses++;
+  }
+
+  size_type current = ++in_use, peak = peak_in_use.load();
+  while(current > peak && !(peak_in_use.compare_exchange_weak(peak, current))) {}
+  return block;
+}
+
+void
+BlockPool::release(value_type* block, size_type used)
+{
+  in_use--;
+  if(retained++ >= max_retained / BlockArray::BLOCK_SIZE)
+  {
+    retained--;
+    munmap((void*)block, BlockArray::BLOCK_SIZE);
+    return;
+  }
+
+  std::memset((void*)block, 0, used);
+  if(block_cache.blocks.size() >= THREAD_CACHE)
+  {
+    std::lock_guard<std::mutex> lock(shared_blocks_lock);
+    shared_blocks.insert(shared_blocks.end(), block_cache.blocks.begin(), block_cache.blocks.end());
+    block_cache.blocks.clear();
+  }
+  block_cache.blocks.push_back(block);
+}
+
+//------------------------------------------------------------------------------
+
+size_type
+RunBlock::ranksScalar(const code_type* block, size_type limit, size_type* counts, comp_type& last)
+{
+  size_type i = 0, total = 0;
+  while(total < limit)
+  {
+    range_type run = Run::read(block, i);
+    total += run.second; counts[run.first] += run.second; last = run.first;
+  }
+  return total;
+}
+
+#ifdef BWTMERGE_X86_KERNELS
+
+/*
+  In the vectorized kernels, each code is expanded to a 16-bit lane. For codes below
+  LONG_RUN, code / SIGMA == (code * 171) >> 10, and the total length of a chunk
+  fits in a signed 16-bit integer.
+*/
+
+__attribute__((target("avx2")))
+inline __m256i
+prefixSum16(__m256i x)
+{
+  x = _mm256_add_epi16(x, _mm256_slli_si256(x, 2));
+  x = _mm256_add_epi16(x, _mm256_slli_si256(x, 4));
+  x = _mm256_add_epi16(x, _mm256_slli_si256(x, 8));
+
+  // Add the total of the low 128-bit lane to the high lane.
+  __m256i low_total = _mm256_shuffle_epi8(x, _mm256_set1_epi16(0x0F0E));
+  return _mm256_add_epi16(x, _mm256_permute2x128_si256(low_total, low_total, 0x08));
+}
+
+__attribute__((target("avx2")))
+inline size_type
+horizontalSum16(__m256i x)
+{
+  __m256i pairs = _mm256_madd_epi16(x, _mm256_set1_epi16(1));
+  __m128i sums = _mm_add_epi32(_mm256_castsi256_si128(pairs), _mm256_extracti128_si256(pairs, 1));
+  sums = _mm_hadd_epi32(sums, sums); sums = _mm_hadd_epi32(sums, sums);
+  return _mm_cvtsi128_si32(sums);
+}
+
+/*
+  The chunk kernels process RunBlock::CHUNK_SIZE bytes. They return false without
+  doing anything if the chunk contains long runs. Otherwise they process the runs
+  until the limit or the end of the chunk and add their total length to 'total'.
+*/
+
+__attribute__((target("avx2")))
+inline bool
+chunkRanksAVX2(const RunBlock::code_type* chunk, size_type limit, size_type* counts, RunBlock::comp_type& last, size_type& total)
+{
+  const size_type VECTORS = RunBlock::CHUNK_SIZE / 16;
+
+  __m256i low = _mm256_loadu_si256((const __m256i*)chunk);
+  __m256i high = _mm256_loadu_si256((const __m256i*)(chunk + 32));
+  __m256i long_run = _mm256_set1_epi8((char)RunBlock::LONG_RUN);
+  __m256i has_long = _mm256_or_si256(_mm256_cmpeq_epi8(_mm256_max_epu8(low, long_run), low),
+                                     _mm256_cmpeq_epi8(_mm256_max_epu8(high, long_run), high));
+  if(_mm256_movemask_epi8(has_long) != 0) { return false; }
+  limit = std::min(limit, RunBlock::CHUNK_SIZE * Run::MAX_RUN);
+
+  __m256i codes[VECTORS] =
+  {
+    _mm256_cvtepu8_epi16(_mm256_castsi256_si128(low)), _mm256_cvtepu8_epi16(_mm256_extracti128_si256(low, 1)),
+    _mm256_cvtepu8_epi16(_mm256_castsi256_si128(high)), _mm256_cvtepu8_epi16(_mm256_extracti128_si256(high, 1))
+  };
+
+  // Find the first run where the total length reaches the limit.
+  __m256i lengths[VECTORS], comps[VECTORS];
+  __m256i carry = _mm256_setzero_si256(), bound = _mm256_set1_epi16((short)(limit - 1));
+  size_type runs = 0;
+  for(size_type v = 0; v < VECTORS; v++)
+  {
+    __m256i quotient = _mm256_srli_epi16(_mm256_mullo_epi16(codes[v], _mm256_set1_epi16(171)), 10);
+    comps[v] = _mm256_sub_epi16(codes[v], _mm256_mullo_epi16(quotient, _mm256_set1_epi16(Run::SIGMA)));
+    lengths[v] = _mm256_add_epi16(quotient, _mm256_set1_epi16(1));
+    __m256i prefix = _mm256_add_epi16(prefixSum16(lengths[v]), carry);
+    carry = _mm256_set1_epi16((short)_mm256_extract_epi16(prefix, 15));
+    unsigned mask = _mm256_movemask_epi8(_mm256_cmpgt_epi16(prefix, bound));
+    if(runs == 0 && mask != 0) { runs = 16 * v + __builtin_ctz(mask) / 2 + 1; }
+  }
+  if(runs == 0) { runs = RunBlock::CHUNK_SIZE; }
+
+  // Sum the lengths of the first 'runs' runs by comp value.
+  __m256i lane = _mm256_setr_epi16(0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15);
+  __m256i sums[Run::SIGMA];
+  for(size_type c = 0; c < Run::SIGMA; c++) { sums[c] = _mm256_setzero_si256(); }
+  for(size_type v = 0; v < VECTORS; v++)
+  {
+    __m256i keep = _mm256_cmpgt_epi16(_mm256_set1_epi16((short)(runs - 16 * v)), lane);
+    __m256i kept = _mm256_and_si256(lengths[v], keep);
+    for(size_type c = 0; c < Run::SIGMA; c++)
+    {
+      __m256i is_c = _mm256_cmpeq_epi16(comps[v], _mm256_set1_epi16((short)c));
+      sums[c] = _mm256_add_epi16(sums[c], _mm256_and_si256(kept, is_c));
+    }
+  }
+
+  for(size_type c = 0; c < Run::SIGMA; c++)
+  {
+    size_type sum = horizontalSum16(sums[c]);
+    counts[c] += sum; total += sum;
+  }
+  last = chunk[runs - 1] % Run::SIGMA;
+  return true;
+}
+
+__attribute__((target("avx2")))
+size_type
+RunBlock::ranksAVX2(const code_type* block, size_type limit, size_type* counts, comp_type& last)
+{
+  size_type total = 0;
+  for(size_type offset = 0; offset < Run::BLOCK_SIZE && total < limit; offset += CHUNK_SIZE)
+  {
+    if(!chunkRanksAVX2(block + offset, limit - total, counts, last, total))
+    {
+      return total + ranksScalar(block + offset, limit - total, counts, last);
+    }
+  }
+  return total;
+}
+
+__attribute__((target("avx512f,avx512bw")))
+inline __m512i
+prefixSum32(__m512i x, __m512i lane)
+{
+  for(size_type shift = 1; shift < 32; shift *= 2)
+  {
+    __mmask32 valid = ~(__mmask32)((1U << shift) - 1);
+    __m512i shifted = _mm512_maskz_permutexvar_epi16(valid, _mm512_sub_epi16(lane, _mm512_set1_epi16((short)shift)), x);
+    x = _mm512_add_epi16(x, shifted);
+  }
+  return x;
+}
+
+__attribute__((target("avx512f,avx512bw")))
+inline bool
+chunkRanksAVX512(const RunBlock::code_type* chunk, size_type limit, size_type* counts, RunBlock::comp_type& last, size_type& total)
+{
+  __m512i bytes = _mm512_loadu_si512((const void*)chunk);
+  if(_mm512_cmpge_epu8_mask(bytes, _mm512_set1_epi8((char)RunBlock::LONG_RUN)) != 0) { return false; }
+  limit = std::min(limit, RunBlock::CHUNK_SIZE * Run::MAX_RUN);
+
+  const static uint16_t lanes[32] =
+  {
+     0,  1,  2,  3,  4,  5,  6,  7,  8,  9, 10, 11, 12, 13, 14, 15,
+    16, 17, 18, 19, 20, 21, 22, 23, 24, 25, 26, 27, 28, 29, 30, 31
+  };
+  __m512i lane = _mm512_loadu_si512((const void*)lanes);
+  __m512i codes[2] =
+  {
+    _mm512_cvtepu8_epi16(_mm256_loadu_si256((const __m256i*)chunk)),
+    _mm512_cvtepu8_epi16(_mm256_loadu_si256((const __m256i*)(chunk + 32)))
+  };
+
+  // Find the first run where the total length reaches the limit.
+  __m512i lengths[2], comps[2];
+  __m512i carry = _mm512_setzero_si512(), bound = _mm512_set1_epi16((short)(limit - 1));
+  uint64_t reached = 0;
+  for(size_type v = 0; v < 2; v++)
+  {
+    __m512i quotient = _mm512_srli_epi16(_mm512_mullo_epi16(codes[v], _mm512_set1_epi16(171)), 10);
+    comps[v] = _mm512_sub_epi16(codes[v], _mm512_mullo_epi16(quotient, _mm512_set1_epi16(Run::SIGMA)));
+    lengths[v] = _mm512_add_epi16(quotient, _mm512_set1_epi16(1));
+    __m512i prefix = _mm512_add_epi16(prefixSum32(lengths[v], lane), carry);
+    carry = _mm512_permutexvar_epi16(_mm512_set1_epi16(31), prefix);
+    reached |= (uint64_t)_mm512_cmpgt_epi16_mask(prefix, bound) << (32 * v);
+  }
+
+  // Sum the lengths of the first 'runs' runs by comp value. The sums fit in bytes.
+  size_type runs = (reached != 0 ? __builtin_ctzll(reached) + 1 : RunBlock::CHUNK_SIZE);
+  uint64_t keep = (runs >= 64 ? ~(uint64_t)0 : ((uint64_t)1 << runs) - 1);
+  for(size_type c = 0; c < Run::SIGMA; c++)
+  {
+    __m512i target = _mm512_set1_epi16((short)c);
+    __mmask32 low = _mm512_mask_cmpeq_epi16_mask((__mmask32)keep, comps[0], target);
+    __mmask32 high = _mm512_mask_cmpeq_epi16_mask((__mmask32)(keep >> 32), comps[1], target);
+    __m256i sum = _mm256_add_epi8(_mm512_maskz_cvtepi16_epi8(low, lengths[0]), _mm512_maskz_cvtepi16_epi8(high, lengths[1]));
+    __m256i partial = _mm256_sad_epu8(sum, _mm256_setzero_si256());
+    __m128i halves = _mm_add_epi64(_mm256_castsi256_si128(partial), _mm256_extracti128_si256(partial, 1));
+    size_type count = _mm_cvtsi128_si64(halves) + _mm_extract_epi64(halves, 1);
+    counts[c] += count; total += count;
+  }
+  last = chunk[runs - 1] % Run::SIGMA;
+  return true;
+}
+
+__attribute__((target("avx512f,avx512bw")))
+size_type
+RunBlock::ranksAVX512(const code_type* block, size_type limit, size_type* counts, comp_type& last)
+{
+  size_type total = 0;
+  for(size_type offset = 0; offset < Run::BLOCK_SIZE && total < limit; offset += CHUNK_SIZE)
+  {
+    if(!chunkRanksAVX512(block + offset, limit - total, counts, last, total))
+    {
+      return total + ranksScalar(block + offset, limit - total, counts, last);
+    }
+  }
+  return total;
+}
+
+#else
+
+size_type
+RunBlock::ranksAVX2(const code_type* block, size_type limit, size_type* counts, comp_type& last)
+{
+  return ranksScalar(block, limit, counts, last);
+}
+
+size_type
+RunBlock::ranksAVX512(const code_type* block, size_type limit, size_type* counts, comp_type& last)
+{
+  return ranksScalar(block, limit, counts, last);
+}
+
+#endif
+
+std::string
+rankKernelName()
+{
+#ifdef BWTMERGE_X86_KERNELS
+  if(Run::BLOCK_SIZE % RunBlock::CHUNK_SIZE != 0) { return "scalar"; }
+  __builtin_cpu_init();
+  if(__builtin_cpu_supports("avx512bw")) { return "avx512bw"; }
+  if(__builtin_cpu_supports("avx2")) { return "avx2"; }
+#endif
+  return "scalar";
+}
+
+std::string RunBlock::kernel_name = rankKernelName();
+
+RunBlock::rank_kernel
+rankKernel()
+{
+  if(RunBlock::kernel_name == "avx512bw") { return RunBlock::ranksAVX512; }
+  if(RunBlock::kernel_name == "avx2") { return RunBlock::ranksAVX2; }
+  return RunBlock::ranksScalar;
+}
+
+RunBlock::rank_kernel RunBlock::ranks = rankKernel();
+
+//------------------------------------------------------------------------------
+
+BlockHeaders::BlockHeaders() :
+  data(0), headers(0)
+{
+}
+
+BlockHeaders::BlockHeaders(const BlockHeaders& source) :
+  data(0), headers(0)
+{
+  this->copy(source);
+}
+
+BlockHeaders::BlockHeaders(BlockHeaders&& source) :
+  data(0), headers(0)
+{
+  *this = std::move(source);
+}
+
+BlockHeaders::~BlockHeaders()
+{
+  this->clear();
+}
+
+void
+BlockHeaders::copy(const BlockHeaders& source)
+{
+  this->resize(source.size());
+  if(!(this->empty())) { std::memcpy((void*)(this->data), (void*)(source.data), this->size() * sizeof(Header)); }
+}
+
+void
+BlockHeaders::swap(BlockHeaders& source)
+{
+  if(this != &source)
+  {
+    std::swap(this->data, source.data);
+    std::swap(this->headers, source.headers);
+  }
+}
+
+BlockHeaders&
+BlockHeaders::operator=(const BlockHeaders& source)
+{
+  if(this != &source) { this->copy(source); }
+  return *this;
+}
+
+BlockHeaders&
+BlockHeaders::operator=(BlockHeaders&& source)
+{
+  if(this != &source)
+  {
+    this->clear();
+    this->swap(source);
+  }
+  return *this;
+}
+
+void
+BlockHeaders::resize(size_type n)
+{
+  this->clear();
+  if(n == 0) { return; }
+  this->data = (Header*)mmap(0, n * sizeof(Header), PROT_READ | PROT_WRITE, MAP_ANON | MAP_PRIVATE, -1, 0);
+  this->headers = n;
+}
+
+void
+BlockHeaders::clear()
+{
+  if(this->data != 0) { munmap((void*)(this->data), this->size() * sizeof(Header)); }
+  this->data = 0; this->headers = 0;
+}
+
+//------------------------------------------------------------------------------
+
 CumulativeArray::CumulativeArray()
 {
   this->m_size = 0;
@@ -465,12 +940,165 @@ CumulativeArray::load(std::istream& in)
 
 //------------------------------------------------------------------------------
 
-void open(RLArray<sdsl::int_vector_buffer<8>>& array, const std::string filename,
-  size_type runs, size_type values)
+// Decodes a single value if it ends before 'available'.
+inline bool
+readValue(const ByteCode::code_type* data, size_type available, size_type& pos, ByteCode::value_type& value)
 {
-  array.data = sdsl::int_vector_buffer<8>(filename);
-  array.run_count = runs;
-  array.value_count = values;
+  size_type offset = 0;
+  value = 0;
+  for(size_type i = pos; i < available; i++, offset += ByteCode::DATA_BITS)
+  {
+    value += ((ByteCode::value_type)(data[i] & ByteCode::DATA_MASK)) << offset;
+    if(!(data[i] & ByteCode::NEXT_BYTE)) { pos = i + 1; return true; }
+  }
+  return false;
+}
+
+size_type
+ByteCode::readBatchScalar(const code_type* data, size_type available, value_type* values, size_type n, size_type& bytes)
+{
+  size_type count = 0, pos = 0;
+  while(count < n && readValue(data, available, pos, values[count])) { count++; }
+  bytes = pos;
+  return count;
+}
+
+#ifdef BWTMERGE_X86_KERNELS
+
+/*
+  Shuffle table for the vectorized kernel. For each combination of continuation bits in
+  8 bytes, the entry stores the number of leading one-byte and two-byte values, the
+  number of bytes they use, and a shuffle placing value j into 16-bit lane j.
+*/
+struct ByteCodeShuffle
+{
+  uint8_t control[16];
+  uint8_t values, bytes;
+};
+
+std::vector<ByteCodeShuffle>
+byteCodeShuffles()
+{
+  std::vector<ByteCodeShuffle> result(256);
+  for(size_type mask = 0; mask < result.size(); mask++)
+  {
+    ByteCodeShuffle& entry = result[mask];
+    for(size_type i = 0; i < 16; i++) { entry.control[i] = 0x80; }
+    size_type values = 0, pos = 0;
+    while(pos < 8)
+    {
+      if(!(mask & (1 << pos))) { entry.control[2 * values] = pos; pos++; }
+      else if(pos + 1 < 8 && !(mask & (1 << (pos + 1))))
+      {
+        entry.control[2 * values] = pos; entry.control[2 * values + 1] = pos + 1; pos += 2;
+      }
+      else { break; }
+      values++;
+    }
+    entry.values = values; entry.bytes = pos;
+  }
+  return result;
+}
+
+const std::vector<ByteCodeShuffle> BYTE_CODE_SHUFFLES = byteCodeShuffles();
+
+__attribute__((target("ssse3")))
+size_type
+ByteCode::readBatchSSSE3(const code_type* data, size_type available, value_type* values, size_type n, size_type& bytes)
+{
+  size_type count = 0, pos = 0;
+  const __m128i zero = _mm_setzero_si128();
+  const __m128i low_mask = _mm_set1_epi16(DATA_MASK), high_mask = _mm_set1_epi16(DATA_MASK << 8);
+  while(count + 8 <= n && pos + 16 <= available)
+  {
+    __m128i chunk = _mm_loadu_si128((const __m128i*)(data + pos));
+    unsigned mask = _mm_movemask_epi8(chunk);
+
+    // Expand 16 one-byte values or decode the leading short values in the first 8 bytes.
+    __m128i lanes[2];
+    size_type decoded = 16, used = 16;
+    if(mask == 0 && count + 16 <= n)
+    {
+      lanes[0] = _mm_unpacklo_epi8(chunk, zero); lanes[1] = _mm_unpackhi_epi8(chunk, zero);
+    }
+    else
+    {
+      const ByteCodeShuffle& entry = BYTE_CODE_SHUFFLES[mask & 0xFF];
+      if(entry.values == 0)
+      {
+        if(!readValue(data, available, pos, values[count])) { break; }
+        count++; continue;
+      }
+      __m128i shuffled = _mm_shuffle_epi8(chunk, _mm_loadu_si128((const __m128i*)(entry.control)));
+      lanes[0] = _mm_or_si128(_mm_and_si128(shuffled, low_mask), _mm_srli_epi16(_mm_and_si128(shuffled, high_mask), 1));
+      decoded = entry.values; used = entry.bytes;
+    }
+    for(size_type l = 0; l < (decoded > 8 ? 2 : 1); l++)
+    {
+      __m128i dwords[2] = { _mm_unpacklo_epi16(lanes[l], zero), _mm_unpackhi_epi16(lanes[l], zero) };
+      for(size_type d = 0; d < 2; d++)
+      {
+        __m128i* out = (__m128i*)(values + count + 8 * l + 4 * d);
+        _mm_storeu_si128(out, _mm_unpacklo_epi32(dwords[d], zero));
+        _mm_storeu_si128(out + 1, _mm_unpackhi_epi32(dwords[d], zero));
+      }
+    }
+    count += decoded; pos += used;
+  }
+
+  size_type tail = 0;
+  count += readBatchScalar(data + pos, available - pos, values + count, n - count, tail);
+  bytes = pos + tail;
+  return count;
+}
+
+#else
+
+size_type
+ByteCode::readBatchSSSE3(const code_type* data, size_type available, value_type* values, size_type n, size_type& bytes)
+{
+  return readBatchScalar(data, available, values, n, bytes);
+}
+
+#endif
+
+std::string
+byteCodeKernelName()
+{
+#ifdef BWTMERGE_X86_KERNELS
+  __builtin_cpu_init();
+  if(__builtin_cpu_supports("ssse3")) { return "ssse3"; }
+#endif
+  return "scalar";
+}
+
+std::string ByteCode::kernel_name = byteCodeKernelName();
+
+ByteCode::batch_kernel
+byteCodeKernel()
+{
+  if(ByteCode::kernel_name == "ssse3") { return ByteCode::readBatchSSSE3; }
+  return ByteCode::readBatchScalar;
+}
+
+ByteCode::batch_kernel ByteCode::readBatch = byteCodeKernel();
+
+//------------------------------------------------------------------------------
+
+RunCodec::codec_type RunCodec::codec = RunCodec::PACKED;
+
+bool
+RunCodec::parse(const std::string& name, codec_type& result)
+{
+  if(name == "bytecode") { result = BYTE_CODE; return true; }
+  if(name == "packed") { result = PACKED; return true; }
+  return false;
+}
+
+std::string
+RunCodec::name(codec_type codec)
+{
+  return (codec == BYTE_CODE ? "bytecode" : "packed");
 }
 
 template<>
@@ -480,6 +1108,7 @@ RLArray<BlockArray>::clear()
   this->data.clear();
   this->run_count = 0;
   this->value_count = 0;
+  this->samples.clear();
 }
 
 template<>
@@ -489,6 +1118,7 @@ RLArray<sdsl::int_vector_buffer<8>>::clear()
   this->data.close();
   this->run_count = 0;
   this->value_count = 0;
+  this->samples.clear();
 }
 
 template<>
@@ -517,14 +1147,81 @@ template<>
 void
 RLIterator<BlockArray>::read()
 {
-  if(this->end()) { this->run.first = ~(value_type)0; this->run.second = ~(length_type)0; return; }
-  this->run.first += ByteCode::read(this->array->data, this->ptr);
-  this->run.second = ByteCode::read(this->array->data, this->ptr);
+  if(this->end()) { this->decoder.run.first = ~(value_type)0; this->decoder.run.second = ~(length_type)0; return; }
+  this->decoder.next(this->array->data, this->ptr, this->array->size() - this->pos);
   this->array->data.clearUntil(this->ptr);
 }
 
 //------------------------------------------------------------------------------
 
+RLFile::RLFile() :
+  mapping(nullptr), mapped_bytes(0), released_bytes(0),
+  bytes { nullptr, 0 }, ptr(0), release_point(0), runs(0)
+{
+}
+
+RLFile::~RLFile()
+{
+  this->close();
+}
+
+void
+RLFile::open(const std::string& filename, size_type run_count, RunCodec::codec_type codec)
+{
+  this->close();
+
+  int fd = ::open(filename.c_str(), O_RDONLY);
+  struct stat info;
+  if(fd < 0 || fstat(fd, &info) != 0 || (size_type)(info.st_size) < HEADER_SIZE)
+  {
+    std::cerr << "RLFile::open(): Cannot open file " << filename << std::endl;
+    std::exit(EXIT_FAILURE);
+  }
+  this->mapped_bytes = info.st_size;
+  void* addr = mmap(0, this->mapped_bytes, PROT_READ, MAP_SHARED, fd, 0);
+  ::close(fd);
+  if(addr == MAP_FAILED)
+  {
+    std::cerr << "RLFile::open(): Cannot map file " << filename << std::endl;
+    std::exit(EXIT_FAILURE);
+  }
+  madvise(addr, this->mapped_bytes, MADV_SEQUENTIAL);
+
+  this->mapping = (const byte_type*)addr;
+  this->bytes = this->data(); this->ptr = 0;
+  this->release_point = RELEASE_SIZE;
+  this->runs = run_count;
+  this->decoder = RunDecoder(codec);
+}
+
+void
+RLFile::close()
+{
+  if(this->mapping != nullptr) { munmap((void*)(this->mapping), this->mapped_bytes); }
+  this->mapping = nullptr; this->mapped_bytes = 0; this->released_bytes = 0;
+  this->bytes = ByteSpan { nullptr, 0 }; this->ptr = 0; this->release_point = 0;
+  this->runs = 0;
+}
+
+void
+RLFile::prefetch(size_type bytes)
+{
+  if(this->mapping == nullptr) { return; }
+  madvise((void*)(this->mapping), std::min(bytes, this->mapped_bytes), MADV_WILLNEED);
+}
+
+void
+RLFile::release()
+{
+  // The mapping is page-aligned, so multiples of RELEASE_SIZE are as well.
+  size_type bytes = ((HEADER_SIZE + this->ptr) / RELEASE_SIZE) * RELEASE_SIZE;
+  madvise((void*)(this->mapping + this->released_bytes), bytes - this->released_bytes, MADV_DONTNEED);
+  this->released_bytes = bytes;
+  this->release_point = bytes + RELEASE_SIZE - HEADER_SIZE;
+}
+
+//------------------------------------------------------------------------------
+
 RankArray::RankArray()
 {
 }
@@ -532,6 +1229,8 @@ RankArray::RankArray()
 RankArray::~RankArray()
 {
   this->close();
+  this->closeFiles();
+  this->buffers.clear();
   for(size_type i = 0; i < this->filenames.size(); i++) { remove(this->filenames[i].c_str()); }
 }
 
@@ -539,38 +1238,228 @@ void
 RankArray::open()
 {
   this->close();
-  this->inputs = std::vector<array_type>(this->size());
-  this->iterators = std::vector<iterator>(this->size());
+  this->buffer_iterators.reserve(this->buffers.size());
+  this->files = std::vector<RLFile>(this->filenames.size());
+  this->heads.reserve(this->size());
 
-  for(size_type i = 0; i < this->size(); i++)
+  for(size_type i = 0; i < this->buffers.size(); i++)
+  {
+    this->buffer_iterators.push_back(buffer_iterator(this->buffers[i]));
+    this->heads.push_back(*(this->buffer_iterators[i]));
+  }
+  // The files may be on different devices. Start reading all of them at once.
+  for(size_type i = 0; i < this->filenames.size(); i++)
   {
-    bwtmerge::open(this->inputs[i], this->filenames[i], this->run_counts[i], this->value_counts[i]);
-    this->iterators[i] = iterator(this->inputs[i]);
+    this->files[i].open(this->filenames[i], this->run_counts[i], this->file_codecs[i]);
+    this->files[i].prefetch(PREFETCH_SIZE);
   }
+  for(size_type i = 0; i < this->filenames.size(); i++) { this->heads.push_back(this->files[i].next()); }
 
-  this->heapify();
+  std::vector<size_type> keys(this->heads.size());
+  for(size_type i = 0; i < keys.size(); i++) { keys[i] = this->heads[i].first; }
+  this->tree.build(keys);
 }
 
 void
 RankArray::close()
 {
-  this->iterators.clear();
-  for(size_type i = 0; i < this->inputs.size(); i++) { this->inputs[i].clear(); }
-  this->inputs.clear();
+  this->heads.clear();
+  this->tree.clear();
+  this->buffer_iterators.clear();
+  this->files.clear();
+}
+
+std::vector<size_type>
+RankArray::splitPoints(size_type runs) const
+{
+  std::vector<size_type> values;
+  for(size_type i = 0; i < this->buffers.size(); i++)
+  {
+    const std::vector<RLSample>& samples = this->buffers[i].samples;
+    for(size_type j = 1; j < samples.size(); j++) { values.push_back(samples[j].prev); }
+  }
+  for(size_type i = 0; i < this->file_samples.size(); i++)
+  {
+    const std::vector<RLSample>& samples = this->file_samples[i];
+    for(size_type j = 1; j < samples.size(); j++) { values.push_back(samples[j].prev); }
+  }
+  std::sort(values.begin(), values.end());
+
+  std::vector<size_type> result;
+  size_type step = std::max(runs / buffer_type::SAMPLE_RATE, (size_type)1);
+  for(size_type i = step; i < values.size(); i += step)
+  {
+    if(result.empty() || values[i] > result.back()) { result.push_back(values[i]); }
+  }
+  return result;
+}
+
+size_type
+RankArray::fullLevel(size_type n) const
+{
+  std::vector<size_type> counts;
+  for(size_type i = 0; i < this->file_levels.size(); i++)
+  {
+    size_type level = this->file_levels[i];
+    if(level >= counts.size()) { counts.resize(level + 1, 0); }
+    counts[level]++;
+  }
+  for(size_type level = 0; level < counts.size(); level++)
+  {
+    if(counts[level] >= n) { return level; }
+  }
+  return ~(size_type)0;
+}
+
+void
+RankArray::moveLevel(size_type level, RankArray& target)
+{
+  std::vector<bool> moved(this->filenames.size(), false);
+  for(size_type i = 0; i < moved.size(); i++) { moved[i] = (this->file_levels[i] == level); }
+  this->moveFiles(moved, target);
 }
 
 void
-RankArray::heapify()
+RankArray::moveFiles(size_type n, RankArray& target)
 {
-  if(this->size() <= 1) { return; }
+  std::vector<size_type> order(this->filenames.size());
+  for(size_type i = 0; i < order.size(); i++) { order[i] = i; }
+  std::stable_sort(order.begin(), order.end(),
+    [this](size_type a, size_type b) { return (this->run_counts[a] < this->run_counts[b]); });
+  std::vector<bool> moved(this->filenames.size(), false);
+  for(size_type i = 0; i < std::min(n, order.size()); i++) { moved[order[i]] = true; }
+  this->moveFiles(moved, target);
+}
 
-  size_type i = parent(this->size() - 1);
-  while(true)
+void
+RankArray::moveFiles(const std::vector<bool>& moved, RankArray& target)
+{
+  size_type tail = 0;
+  for(size_type i = 0; i < this->filenames.size(); i++)
   {
-    this->down(i);
-    if(i == 0) { break; }
-    i--;
+    if(moved[i])
+    {
+      target.filenames.push_back(this->filenames[i]);
+      target.run_counts.push_back(this->run_counts[i]);
+      target.value_counts.push_back(this->value_counts[i]);
+      target.file_codecs.push_back(this->file_codecs[i]);
+      target.file_levels.push_back(this->file_levels[i]);
+      target.file_samples.push_back(std::vector<RLSample>());
+      target.file_samples.back().swap(this->file_samples[i]);
+    }
+    else
+    {
+      this->filenames[tail] = this->filenames[i];
+      this->run_counts[tail] = this->run_counts[i];
+      this->value_counts[tail] = this->value_counts[i];
+      this->file_codecs[tail] = this->file_codecs[i];
+      this->file_levels[tail] = this->file_levels[i];
+      this->file_samples[tail].swap(this->file_samples[i]);
+      tail++;
+    }
+  }
+  this->filenames.resize(tail);
+  this->run_counts.resize(tail);
+  this->value_counts.resize(tail);
+  this->file_codecs.resize(tail);
+  this->file_levels.resize(tail);
+  this->file_samples.resize(tail);
+}
+
+void
+RankArray::merge(const std::string& filename)
+{
+  array_type output;
+  output.data = sdsl::int_vector_buffer<8>(filename, std::ios::out);
+  size_type prev = 0;
+  RunBuffer run_buffer;
+  for(this->open(); !(this->end()); ++(*this))
+  {
+    if(run_buffer.add(**this)) { output.addRun(run_buffer.run, prev); }
+  }
+  run_buffer.flush();
+  if(run_buffer.run.second > 0) { output.addRun(run_buffer.run, prev); }
+  output.flush();
+  this->close();
+  output.data.close();
+
+  size_type level = 0;
+  for(size_type i = 0; i < this->file_levels.size(); i++) { level = std::max(level, this->file_levels[i] + 1); }
+
+  this->buffers.clear();
+  for(size_type i = 0; i < this->filenames.size(); i++) { remove(this->filenames[i].c_str()); }
+  this->filenames = std::vector<std::string>(1, filename);
+  this->file_levels = std::vector<size_type>(1, level);
+  this->run_counts = std::vector<size_type>(1, output.size());
+  this->value_counts = std::vector<size_type>(1, output.values());
+  this->file_codecs = std::vector<RunCodec::codec_type>(1, output.codec);
+  this->file_samples = std::vector<std::vector<RLSample>>(1, std::vector<RLSample>());
+  this->file_samples.back().swap(output.samples);
+}
+
+void
+RankArray::openFiles()
+{
+  this->closeFiles();
+  this->files = std::vector<RLFile>(this->filenames.size());
+  for(size_type i = 0; i < this->filenames.size(); i++)
+  {
+    this->files[i].open(this->filenames[i], this->run_counts[i], this->file_codecs[i]);
+  }
+}
+
+void
+RankArray::closeFiles()
+{
+  this->files.clear();
+}
+
+//------------------------------------------------------------------------------
+
+RARange::RARange(const RankArray& ra, size_type low, size_type _high) :
+  high(_high), values(0)
+{
+  this->sources.reserve(ra.size());
+  for(size_type i = 0; i < ra.buffers.size(); i++)
+  {
+    this->sources.push_back(Source(ra.buffers[i], low, this->values));
+  }
+  for(size_type i = 0; i < ra.filenames.size(); i++)
+  {
+    this->sources.push_back(Source(ra, i, low, this->values));
   }
+
+  std::vector<size_type> keys(this->sources.size());
+  for(size_type i = 0; i < keys.size(); i++) { keys[i] = this->sources[i].decoder.run.first; }
+  this->tree.build(keys);
+}
+
+RARange::Source::Source(const RankArray::buffer_type& buffer, size_type low, size_type& values) :
+  array(&(buffer.data)), bytes { nullptr, 0 }, ptr(0), runs(0), decoder(buffer.codec)
+{
+  this->seek(buffer.samples, buffer.size(), low, values);
+}
+
+RARange::Source::Source(const RankArray& ra, size_type file, size_type low, size_type& values) :
+  array(nullptr), bytes(ra.files[file].data()), ptr(0), runs(0), decoder(ra.file_codecs[file])
+{
+  this->seek(ra.file_samples[file], ra.run_counts[file], low, values);
+}
+
+void
+RARange::Source::seek(const std::vector<RLSample>& samples, size_type run_count, size_type low, size_type& values)
+{
+  if(samples.empty()) { this->next(); return; }
+
+  // Find the last sample with prev < low, or the first sample.
+  size_type sample = std::partition_point(samples.begin() + 1, samples.end(),
+    [low](const RLSample& s) { return (s.prev < low); }) - samples.begin() - 1;
+  this->ptr = samples[sample].ptr;
+  this->runs = run_count - sample * RankArray::buffer_type::SAMPLE_RATE;
+  this->decoder.reset(samples[sample].prev);
+  values += samples[sample].values;
+
+  while(this->next().first < low) { values += this->decoder.run.second; }
 }
 
 //------------------------------------------------------------------------------
@@ -132,6 +132,17 @@ public:
     return this->data[block(i)][offset(i)];
   }
 
+  inline void prefetch(size_type i) const
+  {
+    __builtin_prefetch(this->data[block(i)] + offset(i));
+  }
+
+  // The bytes from i to the end of the block are contiguous.
+  inline const value_type* pointer(size_type i) const
+  {
+    return this->data[block(i)] + offset(i);
+  }
+
   inline void push_back(value_type value)
   {
     if(offset(this->bytes) == 0) { this->allocateBlock(); }
@@ -139,6 +150,9 @@ public:
     this->bytes++;
   }
 
+  // Appends n bytes from the source.
+  void append(const value_type* source, size_type n);
+
   size_type serialize(std::ostream& out, sdsl::structure_tree_node* v = nullptr, std::string name = "") const;
   void load(std::istream& in);
 
@@ -149,6 +163,75 @@ private:
   void copy(const BlockArray& source);
 };  // class BlockArray
 
+/*
+  A process-wide pool of BlockArray blocks. Released blocks are kept for reuse, first in
+  a small per-thread cache and then in a shared list, as long as the pool retains at most
+  max_retained bytes. Other blocks are unmapped. The used part of a block is cleared when
+  it is released, so reused blocks are zero-filled like fresh mappings.
+*/
+struct BlockPool
+{
+  typedef BlockArray::value_type value_type;
+
+  const static size_type MAX_RETAINED = 512 * MEGABYTE;  // Bytes.
+  const static size_type THREAD_CACHE = 4;               // Blocks.
+
+  static value_type* allocate();
+
+  // The first used bytes of the block may be nonzero.
+  static void release(value_type* block, size_type used);
+
+  inline static double defaultRetained() { return inMegabytes(MAX_RETAINED); }
+  inline static void setRetained(size_type mb) { max_retained = mb * MEGABYTE; }
+
+  static size_type max_retained;
+
+  /*
+    With huge pages, new blocks are mapped with MAP_HUGETLB when the system has 2 MB huge
+    pages reserved. Otherwise the blocks are aligned to 2 MB and marked with
+    madvise(MADV_HUGEPAGE), so that transparent huge pages can back them. After the
+    first failed MAP_HUGETLB mapping, only madvise() is used.
+  */
+  const static size_type HUGE_PAGE_SIZE = 2 * MEGABYTE;
+  static bool huge_pages;
+
+  // Transparent huge pages currently used by the process in bytes, or 0 if unknown.
+  static size_type transparentHugePages();
+
+  // Statistics. Blocks in use have been allocated and not released.
+  static std::atomic<size_type> hits, misses, in_use, peak_in_use, retained;
+  static std::atomic<size_type> hugetlb_blocks, advised_blocks;
+};
+
+/*
+  A read-only view of a contiguous byte array, such as a memory-mapped file.
+*/
+struct ByteSpan
+{
+  const byte_type* data;
+  size_type        bytes;
+
+  inline size_type size() const { return this->bytes; }
+  inline byte_type operator[] (size_type i) const { return this->data[i]; }
+};
+
+/*
+  Returns a pointer to array[i] and sets 'available' to the number of bytes that can be
+  read from the pointer. BlockArray blocks are always fully allocated, so the bytes past
+  size() may be read but are not meaningful.
+*/
+inline const byte_type* contiguous(const BlockArray& array, size_type i, size_type& available)
+{
+  available = BlockArray::BLOCK_SIZE - BlockArray::offset(i);
+  return array.pointer(i);
+}
+
+inline const byte_type* contiguous(const ByteSpan& array, size_type i, size_type& available)
+{
+  available = array.size() - i;
+  return array.data + i;
+}
+
 //------------------------------------------------------------------------------
 
 /*
@@ -197,6 +280,44 @@ struct ByteCode
     return res;
   }
 
+  /*
+    Reads n values starting from array[i] and updates i to point to the byte after the
+    last value. The array must support contiguous(). Contiguous parts of the array are
+    decoded with readBatch(), while values crossing a boundary are decoded one at a time.
+  */
+  template<class ByteArray>
+  static void read(const ByteArray& array, size_type& i, value_type* values, size_type n)
+  {
+    size_type done = 0;
+    while(done < n)
+    {
+      size_type available = 0, bytes = 0;
+      const code_type* data = contiguous(array, i, available);
+      done += readBatch(data, available, values + done, n - done, bytes);
+      i += bytes;
+      if(done < n) { values[done] = read(array, i); done++; }
+    }
+  }
+
+  /*
+    Batch kernels. A kernel decodes up to n values that lie entirely within
+    data[0, available) and returns the number of decoded values. It sets bytes to the
+    number of bytes used.
+
+    The vectorized kernel looks at the continuation bits of 8 bytes at a time. A table
+    indexed by the bits gives a shuffle that places each of the leading one-byte and
+    two-byte values into a 16-bit lane, and the values are then decoded in parallel.
+    Longer values are decoded with the scalar code. The best kernel supported by the
+    CPU is chosen at startup.
+  */
+  typedef size_type (*batch_kernel)(const code_type* data, size_type available, value_type* values, size_type n, size_type& bytes);
+
+  static size_type readBatchScalar(const code_type* data, size_type available, value_type* values, size_type n, size_type& bytes);
+  static size_type readBatchSSSE3(const code_type* data, size_type available, value_type* values, size_type n, size_type& bytes);
+
+  static batch_kernel readBatch;
+  static std::string  kernel_name;
+
   /*
     Encodes the value and stores it in the array using push_back().
   */
@@ -215,16 +336,220 @@ struct ByteCode
 //------------------------------------------------------------------------------
 
 /*
-  A run in BWT.
+  Codecs for the runs of RLArray. Each run is stored as the gap from the previous value
+  and the length of the run.
+
+  BYTE_CODE: The gap and the length are encoded with ByteCode.
+
+  PACKED: The runs are stored in blocks of BLOCK_SIZE runs (the last block may be
+  shorter). A block starts with the bit widths of the gaps and the lengths (one byte
+  each), followed by the bit-packed gaps and the bit-packed lengths in LSB order. The
+  block is padded to a byte boundary. Values wider than CHUNK_BITS bits are packed in
+  several chunks.
+
+  New RLArrays use the default codec, and the codec is stored with the array.
+*/
+
+struct RunCodec
+{
+  typedef bwtmerge::size_type               value_type;
+  typedef byte_type                         codec_type;
+  typedef std::pair<value_type, value_type> run_type;
+
+  const static codec_type BYTE_CODE = 0;
+  const static codec_type PACKED    = 1;
+
+  const static size_type BLOCK_SIZE = 64;
+  const static size_type CHUNK_BITS = 32;
+
+  static codec_type codec;  // Default codec.
+
+  // Returns false if the name is not a valid codec.
+  static bool parse(const std::string& name, codec_type& result);
+  static std::string name(codec_type codec);
+
+  /*
+    Encodes a block of n <= BLOCK_SIZE (gap, length) pairs using push_back().
+  */
+  template<class ByteArray>
+  static void writeBlock(ByteArray& array, const run_type* runs, size_type n)
+  {
+    size_type gap_width = 0, length_width = 0;
+    for(size_type i = 0; i < n; i++)
+    {
+      gap_width = std::max(gap_width, bitLength(runs[i].first));
+      length_width = std::max(length_width, bitLength(runs[i].second));
+    }
+    array.push_back(gap_width); array.push_back(length_width);
+
+    size_type buffer = 0, bits = 0;
+    for(size_type i = 0; i < n; i++) { pack(array, runs[i].first, gap_width, buffer, bits); }
+    for(size_type i = 0; i < n; i++) { pack(array, runs[i].second, length_width, buffer, bits); }
+    if(bits > 0) { array.push_back(buffer); }
+  }
+
+  /*
+    Decodes n runs encoded with BYTE_CODE starting from array[i] and updates i to point
+    to the byte after the runs. The ByteCode values are decoded in bulk.
+  */
+  template<class ByteArray>
+  static void readBytes(const ByteArray& array, size_type& i, value_type* gaps, value_type* lengths, size_type n)
+  {
+    value_type values[2 * BLOCK_SIZE];
+    ByteCode::read(array, i, values, 2 * n);
+    for(size_type j = 0; j < n; j++) { gaps[j] = values[2 * j]; lengths[j] = values[2 * j + 1]; }
+  }
+
+  /*
+    Decodes a block of n runs encoded with PACKED starting from array[i] and updates i to
+    point to the byte after the block.
+  */
+  template<class ByteArray>
+  static void readBlock(const ByteArray& array, size_type& i, value_type* gaps, value_type* lengths, size_type n)
+  {
+    size_type gap_width = array[i], length_width = array[i + 1];
+    size_type pos = i + 2, limit = pos + (n * (gap_width + length_width) + 7) / 8;
+    size_type buffer = 0, bits = 0;
+    unpack(array, pos, limit, gap_width, buffer, bits, gaps, n);
+    unpack(array, pos, limit, length_width, buffer, bits, lengths, n);
+    i = limit;
+  }
+
+private:
+  inline static size_type bitLength(value_type value)
+  {
+    return (value == 0 ? 0 : 64 - __builtin_clzll(value));
+  }
+
+  inline static value_type lowBits(value_type value, size_type bits)
+  {
+    return value & ((((value_type)1) << bits) - 1);
+  }
+
+  template<class ByteArray>
+  inline static void pack(ByteArray& array, value_type value, size_type width, size_type& buffer, size_type& bits)
+  {
+    while(width > 0)
+    {
+      size_type chunk = std::min(width, CHUNK_BITS);
+      buffer |= lowBits(value, chunk) << bits; bits += chunk;
+      value >>= chunk; width -= chunk;
+      while(bits >= 8) { array.push_back(buffer & 0xFF); buffer >>= 8; bits -= 8; }
+    }
+  }
+
+  // Adds bytes to the bit buffer without reading past the limit. Requires bits < 32.
+  template<class ByteArray>
+  inline static void refill(const ByteArray& array, size_type& i, size_type limit, size_type& buffer, size_type& bits)
+  {
+    if(i + 4 <= limit)
+    {
+      size_type word = ((size_type)(array[i])) | ((size_type)(array[i + 1]) << 8) |
+                       ((size_type)(array[i + 2]) << 16) | ((size_type)(array[i + 3]) << 24);
+      buffer |= word << bits; i += 4; bits += 32;
+      return;
+    }
+    while(bits <= 56 && i < limit) { buffer |= ((size_type)(array[i])) << bits; i++; bits += 8; }
+  }
+
+  template<class ByteArray>
+  inline static void unpack(const ByteArray& array, size_type& i, size_type limit, size_type width,
+    size_type& buffer, size_type& bits, value_type* values, size_type n)
+  {
+    if(width <= CHUNK_BITS)
+    {
+      for(size_type j = 0; j < n; j++)
+      {
+        if(bits < width) { refill(array, i, limit, buffer, bits); }
+        values[j] = lowBits(buffer, width); buffer >>= width; bits -= width;
+      }
+      return;
+    }
+    for(size_type j = 0; j < n; j++)
+    {
+      values[j] = 0;
+      for(size_type shift = 0; shift < width; shift += CHUNK_BITS)
+      {
+        size_type chunk = std::min(width - shift, CHUNK_BITS);
+        if(bits < chunk) { refill(array, i, limit, buffer, bits); }
+        values[j] |= lowBits(buffer, chunk) << shift; buffer >>= chunk; bits -= chunk;
+      }
+    }
+  }
+};
+
+/*
+  Sequential decoder for the runs of an RLArray. Decoding starts from the beginning of
+  the array or from a sample (see RLArray) after reset(). The runs are decoded in
+  batches of up to RunCodec::BLOCK_SIZE runs, so the array must support contiguous().
+*/
+struct RunDecoder
+{
+  typedef RunCodec::value_type value_type;
+  typedef RunCodec::codec_type codec_type;
+  typedef RunCodec::run_type   run_type;
+
+  explicit RunDecoder(codec_type _codec = RunCodec::BYTE_CODE) :
+    codec(_codec), run(0, 0), block_pos(0), block_size(0)
+  {
+  }
+
+  inline void reset(value_type prev)
+  {
+    this->run = run_type(prev, 0);
+    this->block_pos = this->block_size = 0;
+  }
+
+  /*
+    Decodes the next run starting from array[i] and updates i. The remaining runs,
+    including the next one, must be given.
+  */
+  template<class ByteArray>
+  inline const run_type& next(const ByteArray& array, size_type& i, size_type remaining)
+  {
+    if(this->block_pos >= this->block_size) { this->fill(array, i, remaining); }
+    this->run.first += this->gaps[this->block_pos];
+    this->run.second = this->lengths[this->block_pos];
+    this->block_pos++;
+    return this->run;
+  }
+
+  // Decodes the next batch of runs.
+  template<class ByteArray>
+  void fill(const ByteArray& array, size_type& i, size_type remaining)
+  {
+    this->block_pos = 0; this->block_size = std::min(remaining, RunCodec::BLOCK_SIZE);
+    if(this->codec == RunCodec::BYTE_CODE) { RunCodec::readBytes(array, i, this->gaps, this->lengths, this->block_size); }
+    else { RunCodec::readBlock(array, i, this->gaps, this->lengths, this->block_size); }
+  }
+
+  codec_type codec;
+  run_type   run;
+  size_type  block_pos, block_size;
+  value_type gaps[RunCodec::BLOCK_SIZE], lengths[RunCodec::BLOCK_SIZE];
+};
+
+//------------------------------------------------------------------------------
+
+/*
+  A run in BWT. The block size is a compile-time option: smaller blocks make rank
+  queries faster, while larger blocks make the rank/select structures smaller.
 */
 
+#ifndef BWT_BLOCK_SIZE
+#define BWT_BLOCK_SIZE 64
+#endif
+
+static_assert(BWT_BLOCK_SIZE == 32 || BWT_BLOCK_SIZE == 64 || BWT_BLOCK_SIZE == 128 || BWT_BLOCK_SIZE == 256,
+              "BWT_BLOCK_SIZE must be 32, 64, 128, or 256");
+
 struct Run
 {
   typedef bwtmerge::comp_type    comp_type;
   typedef bwtmerge::size_type    length_type;
   typedef BlockArray::value_type code_type;
 
-  const static size_type   BLOCK_SIZE = 64; // No run can continue past a block boundary.
+  const static size_type   BLOCK_SIZE = BWT_BLOCK_SIZE; // No run can continue past a block boundary.
   const static size_type   SIGMA      = 6;
   const static length_type MAX_RUN    = 256 / SIGMA;  // 42; encoded as 6 * 41
 
@@ -287,6 +612,38 @@ struct Run
 
 //------------------------------------------------------------------------------
 
+/*
+  Rank kernels for a block of Run::BLOCK_SIZE bytes. A kernel reads runs from the
+  start of the block while their total length is less than 'limit' (limit >= 1).
+  It adds the lengths to counts[comp] and sets 'last' to the comp value of the last
+  run. The return value is the total length of the runs.
+
+  The vectorized kernels decode the block in chunks of CHUNK_SIZE bytes. They fall
+  back to the scalar kernel from the first chunk containing runs longer than
+  Run::MAX_RUN - 1. The best kernel supported by the CPU is chosen at startup. The
+  scalar kernel is used if BLOCK_SIZE is not a multiple of CHUNK_SIZE.
+*/
+
+struct RunBlock
+{
+  typedef Run::code_type code_type;
+  typedef Run::comp_type comp_type;
+
+  typedef size_type (*rank_kernel)(const code_type* block, size_type limit, size_type* counts, comp_type& last);
+
+  const static code_type LONG_RUN   = Run::SIGMA * (Run::MAX_RUN - 1); // Smallest code with an extension.
+  const static size_type CHUNK_SIZE = 64;
+
+  static size_type ranksScalar(const code_type* block, size_type limit, size_type* counts, comp_type& last);
+  static size_type ranksAVX2(const code_type* block, size_type limit, size_type* counts, comp_type& last);
+  static size_type ranksAVX512(const code_type* block, size_type limit, size_type* counts, comp_type& last);
+
+  static rank_kernel ranks;
+  static std::string kernel_name;
+};
+
+//------------------------------------------------------------------------------
+
 /*
   This class uses an sd_vector to encode the cumulative sum of an array of integers.
   The array contains sum() items in size() elements. The array uses 0-based indexes.
@@ -381,6 +738,56 @@ private:
 
 //------------------------------------------------------------------------------
 
+/*
+  Dense directory for the blocks of a run-length encoded BWT. Each header occupies one
+  cache line and stores the sequence position at the start of the block and the number
+  of occurrences of each comp value before the block. The headers are stored in
+  mmap'ed memory to keep them aligned.
+
+  Note that there is no support for serialize() / load(). The headers are rebuilt
+  from the samples when they are needed.
+*/
+class BlockHeaders
+{
+public:
+  typedef bwtmerge::size_type size_type;
+
+  struct Header
+  {
+    uint64_t start;
+    uint64_t ranks[Run::SIGMA];
+    uint64_t padding;
+  };
+
+  BlockHeaders();
+  BlockHeaders(const BlockHeaders& source);
+  BlockHeaders(BlockHeaders&& source);
+  ~BlockHeaders();
+
+  void swap(BlockHeaders& source);
+  BlockHeaders& operator=(const BlockHeaders& source);
+  BlockHeaders& operator=(BlockHeaders&& source);
+
+  inline size_type size() const { return this->headers; }
+  inline bool empty() const { return (this->size() == 0); }
+
+  inline const Header& operator[] (size_type i) const { return this->data[i]; }
+  inline Header& operator[] (size_type i) { return this->data[i]; }
+
+  inline void prefetch(size_type i) const { __builtin_prefetch(this->data + i); }
+
+  void resize(size_type n);
+  void clear();
+
+  Header*   data;
+  size_type headers;
+
+private:
+  void copy(const BlockHeaders& source);
+};  // class BlockHeaders
+
+//------------------------------------------------------------------------------
+
 /*
   A run-length encoded non-decreasing integer array, based on any byte array with
   operator[] and member function push_back(). Intended usage is RLArray<BlockArray>
@@ -388,8 +795,20 @@ private:
   and write() are destructive if the array type is BlockArray.
 
   Note that there is no support for serialize() / load().
+
+  The runs are encoded with a RunCodec. With the packed codec, the runs are buffered
+  until a block is full, and flush() must be called after the last addRun().
+
+  Every SAMPLE_RATE-th run is sampled for starting the iteration from the middle. A
+  sample stores the value of the previous run (0 if none), the offset of the sampled
+  run, and the number of values before it.
 */
 
+struct RLSample
+{
+  size_type prev, ptr, values;
+};
+
 template<class ByteArray>
 class RLIterator;
 
@@ -404,21 +823,26 @@ public:
 
   typedef RLIterator<ByteArray> iterator;
 
-  RLArray() { this->run_count = 0; this->value_count = 0; }
+  const static size_type SAMPLE_RATE = 1024;
+
+  static_assert(SAMPLE_RATE % RunCodec::BLOCK_SIZE == 0, "RLArray: Samples must be at the start of a packed block");
+
+  RLArray() { this->run_count = 0; this->value_count = 0; this->codec = RunCodec::codec; }
   RLArray(const RLArray& source) { this->copy(source); }
   RLArray(RLArray&& source) { *this = std::move(source); }
   ~RLArray() { }
 
   /*
-    Builds an RLArray from the source vector. The vector is sorted during construction.
+    Builds an RLArray from a vector of runs. The vector is sorted during construction.
+    Runs with the same value are combined.
   */
   template<class Element>
   explicit RLArray(std::vector<Element>& source)
   {
-    this->run_count = 0; this->value_count = 0;
+    this->run_count = 0; this->value_count = 0; this->codec = RunCodec::codec;
     if(source.empty()) { return; }
 
-    sequentialSort(source.begin(), source.end());
+    radixSort(source);
     value_type prev = 0;
     RunBuffer run_buffer;
     for(size_type i = 0; i < source.size(); i++)
@@ -426,6 +850,7 @@ public:
       if(run_buffer.add(source[i])) { this->addRun(run_buffer.run, prev); }
     }
     run_buffer.flush(); this->addRun(run_buffer.run, prev);
+    this->flush();
   }
 
   /*
@@ -433,7 +858,7 @@ public:
   */
   RLArray(RLArray& a, RLArray& b)
   {
-    this->run_count = 0; this->value_count = 0;
+    this->run_count = 0; this->value_count = 0; this->codec = RunCodec::codec;
     if(a.empty()) { this->swap(b); return; }
     if(b.empty()) { this->swap(a); return; }
 
@@ -448,6 +873,7 @@ public:
       if(run_buffer.add(temp)) { this->addRun(run_buffer.run, prev); }
     }
     run_buffer.flush(); this->addRun(run_buffer.run, prev);
+    this->flush();
 
     a.clear(); b.clear();
   }
@@ -459,6 +885,9 @@ public:
       this->data.swap(source.data);
       std::swap(this->run_count, source.run_count);
       std::swap(this->value_count, source.value_count);
+      this->samples.swap(source.samples);
+      std::swap(this->codec, source.codec);
+      this->pending.swap(source.pending);
     }
   }
 
@@ -476,6 +905,9 @@ public:
       this->data = std::move(source.data);
       this->run_count = std::move(source.run_count);
       this->value_count = std::move(source.value_count);
+      this->samples = std::move(source.samples);
+      this->codec = std::move(source.codec);
+      this->pending = std::move(source.pending);
     }
     return *this;
   }
@@ -488,6 +920,8 @@ public:
   void clear()
   {
     this->run_count = this->value_count = 0;
+    this->samples.clear();
+    this->pending.clear();
   }
 
   void write(const std::string& filename)
@@ -497,8 +931,43 @@ public:
     out.close();
   }
 
-  ByteArray data;
-  size_type run_count, value_count;
+  /*
+    Appends a run with a value larger than the previous value prev (0 if none) and
+    updates prev.
+  */
+  inline void addRun(run_type run, value_type& prev)
+  {
+    if(this->run_count % SAMPLE_RATE == 0)
+    {
+      this->samples.push_back({ prev, this->data.size(), this->value_count });
+    }
+    if(this->codec == RunCodec::BYTE_CODE)
+    {
+      ByteCode::write(this->data, run.first - prev);
+      ByteCode::write(this->data, run.second);
+    }
+    else
+    {
+      this->pending.push_back(run_type(run.first - prev, run.second));
+      if(this->pending.size() >= RunCodec::BLOCK_SIZE) { this->flush(); }
+    }
+    prev = run.first;
+    this->run_count++; this->value_count += run.second;
+  }
+
+  // Encodes the runs buffered for a partial block.
+  void flush()
+  {
+    if(this->pending.empty()) { return; }
+    RunCodec::writeBlock(this->data, this->pending.data(), this->pending.size());
+    this->pending.clear();
+  }
+
+  ByteArray              data;
+  size_type              run_count, value_count;
+  std::vector<RLSample>  samples;
+  RunCodec::codec_type   codec;
+  std::vector<run_type>  pending;  // (gap, length) pairs for the packed codec.
 
 private:
   void copy(const RLArray& source)
@@ -506,19 +975,12 @@ private:
     this->data = source.data;
     this->run_count = source.run_count;
     this->value_count = source.value_count;
-  }
-
-  inline void addRun(run_type run, value_type& prev)
-  {
-    ByteCode::write(this->data, run.first - prev); prev = run.first;
-    ByteCode::write(this->data, run.second);
-    this->run_count++; this->value_count += run.second;
+    this->samples = source.samples;
+    this->codec = source.codec;
+    this->pending = source.pending;
   }
 };  // class RLArray
 
-void open(RLArray<sdsl::int_vector_buffer<8>>& array, const std::string filename,
-  size_type runs, size_type values);
-
 template<> void RLArray<BlockArray>::clear();
 template<> void RLArray<sdsl::int_vector_buffer<8>>::clear();
 template<> void RLArray<BlockArray>::write(const std::string& filename);
@@ -535,36 +997,35 @@ public:
   typedef typename RLArray<ByteArray>::run_type run_type;
 
   inline RLIterator() :
-    array(0), pos(0), ptr(0), run(0, 0)
+    array(0), pos(0), ptr(0)
   {
   }
 
   inline RLIterator(RLArray<ByteArray>& _array) :
-    array(&_array), pos(0), ptr(0), run(0, 0)
+    array(&_array), pos(0), ptr(0), decoder(_array.codec)
   {
     this->read();
   }
 
   inline RLIterator(const RLIterator& source) :
-    array(source.array), pos(source.pos), ptr(source.ptr), run(source.run)
+    array(source.array), pos(source.pos), ptr(source.ptr), decoder(source.decoder)
   {
   }
 
-  inline run_type operator* () const { return this->run; }
-  inline run_type* operator-> () { return &(this->run); }
+  inline run_type operator* () const { return this->decoder.run; }
+  inline const run_type* operator-> () const { return &(this->decoder.run); }
   inline void operator++ () { this->pos++; this->read(); }
   inline bool end() const { return (this->pos >= this->array->size()); }
 
   RLArray<ByteArray>* array;
   size_type pos, ptr;
-  run_type run;
+  RunDecoder decoder;
 
 private:
   inline void read()
   {
-    if(this->end()) { this->run.first = ~(value_type)0; this->run.second = ~(length_type)0; return; }
-    this->run.first += ByteCode::read(this->array->data, this->ptr);
-    this->run.second = ByteCode::read(this->array->data, this->ptr);
+    if(this->end()) { this->decoder.run.first = ~(value_type)0; this->decoder.run.second = ~(length_type)0; return; }
+    this->decoder.next(this->array->data, this->ptr, this->array->size() - this->pos);
   }
 };  // class RLIterator
 
@@ -573,12 +1034,81 @@ void RLIterator<BlockArray>::read();
 
 //------------------------------------------------------------------------------
 
+/*
+  A read-only memory mapping of an RLArray file written with int_vector_buffer<8>. The
+  mapping is advised for sequential access. When the file is iterated with next(), the
+  pages that have already been decoded are released every RELEASE_SIZE bytes.
+*/
+class RLFile
+{
+public:
+  typedef RLArray<BlockArray>::run_type run_type;
+
+  const static size_type HEADER_SIZE  = sizeof(size_type);
+  const static size_type RELEASE_SIZE = 4 * MEGABYTE;
+
+  RLFile();
+  ~RLFile();
+
+  void open(const std::string& filename, size_type runs, RunCodec::codec_type codec);
+  void close();
+
+  // Start reading the first bytes of the file.
+  void prefetch(size_type bytes);
+
+  // The encoded data after the header.
+  inline ByteSpan data() const { return ByteSpan { this->mapping + HEADER_SIZE, this->mapped_bytes - HEADER_SIZE }; }
+
+  /*
+    Returns the next run, or (~0, ~0) if there are no more runs.
+  */
+  inline run_type next()
+  {
+    if(this->runs == 0) { return run_type(~(size_type)0, ~(size_type)0); }
+    this->decoder.next(this->bytes, this->ptr, this->runs);
+    this->runs--;
+    if(this->ptr >= this->release_point) { this->release(); }
+    return this->decoder.run;
+  }
+
+private:
+  void release();
+
+  const byte_type* mapping;
+  size_type        mapped_bytes, released_bytes;
+  ByteSpan         bytes;
+  size_type        ptr, release_point;  // Offsets in bytes.
+  size_type        runs;
+  RunDecoder       decoder;
+
+  /*
+    Not to be used.
+  */
+  RLFile(const RLFile&);
+  RLFile& operator= (const RLFile&);
+};
+
+//------------------------------------------------------------------------------
+
+/*
+  The rank array is the union of sorted RLArrays. Some of them may be kept in memory
+  (buffers), while the rest are stored in temporary files (filenames). The arrays are
+  merged using a loser tree over the head runs, where sources 0 to buffers.size() - 1
+  are the buffers and the rest are the files. Iterating over the rank array destroys the
+  buffers.
+
+  The files are read through memory mappings (RLFile). For parallel iteration, the values
+  can be split into ranges using the samples in the arrays. Each range can then be
+  iterated with an RARange, which reads the shared file mappings and leaves the buffers
+  intact.
+*/
 class RankArray
 {
 public:
+  typedef RLArray<BlockArray>                 buffer_type;
   typedef RLArray<sdsl::int_vector_buffer<8>> array_type;
   typedef array_type::run_type                run_type;
-  typedef array_type::iterator                iterator;
+  typedef buffer_type::iterator               buffer_iterator;
 
   RankArray();
   ~RankArray();
@@ -589,45 +1119,74 @@ public:
   /*
     Iterator operations.
   */
-  inline run_type operator* () const { return *(this->iterators[0]); }
-  inline void operator++ () { ++(this->iterators[0]); this->down(0); }
-  inline bool end() const { return this->iterators[0].end(); }
+  inline run_type operator* () const { return this->heads[this->tree.winner()]; }
 
-  std::vector<std::string> filenames;
-  std::vector<size_type>   run_counts;
-  std::vector<size_type>   value_counts;
+  inline void operator++ ()
+  {
+    size_type source = this->tree.winner();
+    this->heads[source] = this->advance(source);
+    this->tree.replace(this->heads[source].first);
+  }
 
-  std::vector<array_type> inputs;
-  std::vector<iterator>   iterators;
+  inline bool end() const { return (this->tree.empty() || this->tree.key() == ~(size_type)0); }
+
+  inline size_type size() const { return this->buffers.size() + this->filenames.size(); }
 
-private:
   /*
-    Heap operations.
+    Parallel iteration. splitPoints() returns increasing split values so that each range
+    contains approximately the given number of runs. openFiles() must be called before
+    creating RARange objects.
   */
-  inline size_type size() const { return this->filenames.size(); }
-  inline static size_type parent(size_type i) { return (i - 1) / 2; }
-  inline static size_type left(size_type i) { return 2 * i + 1; }
-  inline static size_type right(size_type i) { return 2 * i + 2; }
+  std::vector<size_type> splitPoints(size_type runs) const;
+  void openFiles();
+  void closeFiles();
 
-  inline size_type smaller(size_type i, size_type j) const
-  {
-    return (this->iterators[j].run.first < this->iterators[i].run.first ? j : i);
-  }
+  /*
+    Bounded fan-in with levelled merging. Files written from the merge buffers are at
+    level 0, and merging files produces a file one level above the highest input.
+    fullLevel() returns the lowest level with at least n files, or ~0 if there is no
+    such level. moveLevel() moves the files at the given level to the target, while
+    moveFiles() moves the n files with the fewest runs. merge() merges the entire rank
+    array into a new file, which replaces the current buffers and files.
+  */
+  size_type fullLevel(size_type n) const;
+  void moveLevel(size_type level, RankArray& target);
+  void moveFiles(size_type n, RankArray& target);
+  void merge(const std::string& filename);
+
+  std::vector<buffer_type> buffers;
+
+  std::vector<std::string>           filenames;
+  std::vector<size_type>             run_counts;
+  std::vector<size_type>             value_counts;
+  std::vector<std::vector<RLSample>> file_samples;
+  std::vector<RunCodec::codec_type>  file_codecs;
+  std::vector<size_type>             file_levels;
 
-  inline void down(size_type i)
+  // Start reading this many bytes of each file when opening the files.
+  const static size_type PREFETCH_SIZE = 16 * MEGABYTE;
+
+  std::vector<buffer_iterator> buffer_iterators;
+  std::vector<RLFile>          files;
+
+  std::vector<run_type> heads;
+  LoserTree             tree;
+
+private:
+  /*
+    Source operations.
+  */
+  void moveFiles(const std::vector<bool>& moved, RankArray& target);
+
+  inline run_type advance(size_type source)
   {
-    while(left(i) < this->size())
+    if(source < this->buffer_iterators.size())
     {
-      size_type next = this->smaller(i, left(i));
-      if(right(i) < this->size()) { next = this->smaller(next, right(i)); }
-      if(next == i) { return; }
-      std::swap(this->iterators[i], this->iterators[next]);
-      i = next;
+      ++(this->buffer_iterators[source]); return *(this->buffer_iterators[source]);
     }
+    return this->files[source - this->buffer_iterators.size()].next();
   }
 
-  void heapify();
-
   /*
     Not to be used.
   */
@@ -639,6 +1198,64 @@ private:
 
 //------------------------------------------------------------------------------
 
+/*
+  Iterates over the runs of the rank array with values in [low, high). The sources are
+  positioned using the samples and merged with a loser tree as in RankArray. Runs with the
+  same value from different sources are not combined. offset() is the number of values
+  smaller than low.
+*/
+class RARange
+{
+public:
+  typedef RankArray::run_type run_type;
+
+  RARange(const RankArray& ra, size_type low, size_type high);
+
+  inline run_type operator* () const { return this->sources[this->tree.winner()].decoder.run; }
+
+  inline void operator++ ()
+  {
+    this->tree.replace(this->sources[this->tree.winner()].next().first);
+  }
+
+  inline bool end() const { return (this->tree.empty() || this->tree.key() >= this->high); }
+
+  inline size_type offset() const { return this->values; }
+
+private:
+  /*
+    A source is either an in-memory buffer (array) or a mapped file (bytes). An exhausted
+    source returns run value ~0.
+  */
+  struct Source
+  {
+    Source(const RankArray::buffer_type& buffer, size_type low, size_type& values);
+    Source(const RankArray& ra, size_type file, size_type low, size_type& values);
+
+    void seek(const std::vector<RLSample>& samples, size_type run_count, size_type low, size_type& values);
+
+    inline run_type next()
+    {
+      if(this->runs == 0) { this->decoder.run.first = ~(size_type)0; return this->decoder.run; }
+      if(this->array != nullptr) { this->decoder.next(*(this->array), this->ptr, this->runs); }
+      else { this->decoder.next(this->bytes, this->ptr, this->runs); }
+      this->runs--;
+      return this->decoder.run;
+    }
+
+    const BlockArray* array;
+    ByteSpan          bytes;
+    size_type         ptr, runs;
+    RunDecoder        decoder;
+  };
+
+  std::vector<Source> sources;
+  LoserTree           tree;
+  size_type           high, values;
+};
+
+//------------------------------------------------------------------------------
+
 } // namespace bwtmerge
 
 #endif // _BWTMERGE_SUPPORT_H
@@ -26,6 +26,7 @@
 #include <cstdlib>
 
 #include <sys/resource.h>
+#include <sys/statvfs.h>
 #include <unistd.h>
 
 #include "utils.h"
@@ -161,6 +162,38 @@ fileSize(std::ofstream& file)
   return size;
 }
 
+size_type
+freeSpace(const std::string& directory)
+{
+  struct statvfs info;
+  if(statvfs(directory.c_str(), &info) != 0) { return 0; }
+  return info.f_bavail * info.f_frsize;
+}
+
+//------------------------------------------------------------------------------
+
+void
+LoserTree::build(const std::vector<size_type>& keys)
+{
+  size_type n = keys.size();
+  this->tree = std::vector<Node>(n);
+  this->limit = 0;
+  if(n == 0) { return; }
+
+  // Play the matches bottom-up, keeping the winners of the subtrees in a temporary array.
+  std::vector<Node> winners(2 * n);
+  for(size_type i = 0; i < n; i++) { winners[n + i] = Node { keys[i], i }; }
+  for(size_type node = n - 1; node > 0; node--)
+  {
+    const Node& left = winners[2 * node];
+    const Node& right = winners[2 * node + 1];
+    bool left_wins = (left.key <= right.key);
+    winners[node] = (left_wins ? left : right);
+    this->tree[node] = (left_wins ? right : left);
+  }
+  this->tree[0] = winners[1];
+}
+
 //------------------------------------------------------------------------------
 
 size_type Parallel::max_threads = std::max((unsigned)1, std::thread::hardware_concurrency());
@@ -187,7 +220,7 @@ getBounds(range_type range, size_type blocks)
 }
 
 ParallelLoop::ParallelLoop(size_type start, size_type limit, size_type block_count, size_type thread_count) :
-  tail(0)
+  tail(0), guided(false)
 {
   if(start >= limit) { return; }
 
@@ -196,6 +229,15 @@ ParallelLoop::ParallelLoop(size_type start, size_type limit, size_type block_cou
   this->threads = std::vector<std::thread>(thread_count);
 }
 
+ParallelLoop::ParallelLoop(const std::vector<range_type>& _blocks, size_type thread_count, bool _guided) :
+  tail(0), blocks(_blocks), guided(_guided)
+{
+  if(this->blocks.empty()) { return; }
+
+  thread_count = Range::bound(thread_count, 1, this->blocks.size());
+  this->threads = std::vector<std::thread>(thread_count);
+}
+
 ParallelLoop::~ParallelLoop()
 {
   this->join();
@@ -204,8 +246,22 @@ ParallelLoop::~ParallelLoop()
 range_type
 ParallelLoop::next()
 {
-  size_type block = this->tail++; // Atomic.
-  return (block < this->blocks.size() ? this->blocks[block] : Range::empty_range());
+  if(!(this->guided))
+  {
+    size_type block = this->tail++; // Atomic.
+    return (block < this->blocks.size() ? this->blocks[block] : Range::empty_range());
+  }
+
+  size_type first = this->tail.load();
+  while(first < this->blocks.size())
+  {
+    size_type count = std::max((size_type)1, (this->blocks.size() - first) / (2 * this->threads.size()));
+    if(this->tail.compare_exchange_weak(first, first + count))
+    {
+      return range_type(this->blocks[first].first, this->blocks[first + count - 1].second);
+    }
+  }
+  return Range::empty_range();
 }
 
 void
@@ -143,6 +143,68 @@ struct RunBuffer
 
 //------------------------------------------------------------------------------
 
+/*
+  A loser tree for merging sorted sources by their head keys. Leaf i (node n + i) is
+  source i, and internal node j (1 <= j < n) stores the (key, source) pair losing the
+  match at that node. Node 0 stores the winner. Replacing the key of the winner replays
+  the matches on its path with one comparison per level.
+
+  If the same source wins again after a replay, the smallest key on its path (the
+  runner-up) is cached. As long as the new keys of the winner do not exceed it, the
+  tree is not touched. Exhausted sources should use key ~0.
+*/
+class LoserTree
+{
+public:
+  struct Node
+  {
+    size_type key, source;
+  };
+
+  LoserTree() : limit(0) { }
+
+  // Builds the tree from the head keys of the sources.
+  void build(const std::vector<size_type>& keys);
+
+  inline size_type size() const { return this->tree.size(); }
+  inline bool empty() const { return (this->size() == 0); }
+
+  inline size_type key() const { return this->tree[0].key; }
+  inline size_type winner() const { return this->tree[0].source; }
+
+  // Replaces the key of the winner.
+  inline void replace(size_type key)
+  {
+    if(key <= this->limit) { this->tree[0].key = key; return; }
+
+    Node curr = { key, this->tree[0].source };
+    for(size_type node = (curr.source + this->size()) / 2; node > 0; node /= 2)
+    {
+      if(this->tree[node].key < curr.key) { std::swap(this->tree[node], curr); }
+    }
+    this->limit = (curr.source == this->tree[0].source ? this->runnerUp(curr.source) : 0);
+    this->tree[0] = curr;
+  }
+
+  void clear() { this->tree.clear(); this->limit = 0; }
+
+private:
+  std::vector<Node> tree;
+  size_type         limit;  // The winner stays the winner with keys up to this.
+
+  inline size_type runnerUp(size_type source) const
+  {
+    size_type res = ~(size_type)0;
+    for(size_type node = (source + this->size()) / 2; node > 0; node /= 2)
+    {
+      res = std::min(res, this->tree[node].key);
+    }
+    return res;
+  }
+};
+
+//------------------------------------------------------------------------------
+
 template<class IntegerType>
 inline size_type
 bit_length(IntegerType val)
@@ -225,6 +287,9 @@ std::string tempFile(const std::string& name_part);
 size_type fileSize(std::ifstream& file);
 size_type fileSize(std::ofstream& file);
 
+// Free space available to the user in the file system containing the directory.
+size_type freeSpace(const std::string& directory);
+
 //------------------------------------------------------------------------------
 
 template<class Iterator, class Comparator>
@@ -249,6 +314,76 @@ sequentialSort(Iterator first, Iterator last)
 #endif
 }
 
+/*
+  In-place MSD radix sort (American flag sort) of pairs by the first component, which
+  must be an unsigned integer. Intended for large buffers of (position, length) runs,
+  where it is much faster than comparison sorting. The order of elements with equal
+  first components is unspecified.
+*/
+
+const size_type RADIX_BITS = 8;
+const size_type RADIX_SIZE = (size_type)1 << RADIX_BITS;
+const size_type RADIX_MASK = RADIX_SIZE - 1;
+const size_type RADIX_SORT_THRESHOLD = 256; // Use comparison sorting for smaller ranges.
+
+template<class Element>
+void
+radixSort(Element* data, size_type n, size_type shift)
+{
+  if(n <= RADIX_SORT_THRESHOLD)
+  {
+    sequentialSort(data, data + n, [](const Element& a, const Element& b) { return (a.first < b.first); });
+    return;
+  }
+
+  size_type counts[RADIX_SIZE] = {};
+  for(size_type i = 0; i < n; i++) { counts[(data[i].first >> shift) & RADIX_MASK]++; }
+
+  size_type heads[RADIX_SIZE], tails[RADIX_SIZE];
+  for(size_type bucket = 0, start = 0; bucket < RADIX_SIZE; bucket++)
+  {
+    heads[bucket] = start; start += counts[bucket]; tails[bucket] = start;
+  }
+
+  // Move the elements to their buckets by following the permutation cycles.
+  for(size_type bucket = 0; bucket < RADIX_SIZE; bucket++)
+  {
+    if(counts[bucket] == n) { break; }  // Everything is already in the same bucket.
+    while(heads[bucket] < tails[bucket])
+    {
+      Element value = data[heads[bucket]];
+      size_type digit = (value.first >> shift) & RADIX_MASK;
+      while(digit != bucket)
+      {
+        std::swap(value, data[heads[digit]]); heads[digit]++;
+        digit = (value.first >> shift) & RADIX_MASK;
+      }
+      data[heads[bucket]] = value; heads[bucket]++;
+    }
+  }
+
+  if(shift == 0) { return; }
+  for(size_type bucket = 0, start = 0; bucket < RADIX_SIZE; bucket++)
+  {
+    if(counts[bucket] > 1) { radixSort(data + start, counts[bucket], shift - RADIX_BITS); }
+    start += counts[bucket];
+  }
+}
+
+template<class Element>
+void
+radixSort(std::vector<Element>& data)
+{
+  if(data.size() <= 1) { return; }
+
+  size_type max_value = 0;
+  for(size_type i = 0; i < data.size(); i++) { max_value = std::max(max_value, (size_type)(data[i].first)); }
+  if(max_value == 0) { return; }
+
+  size_type shift = ((bit_length(max_value) - 1) / RADIX_BITS) * RADIX_BITS;
+  radixSort(data.data(), data.size(), shift);
+}
+
 //------------------------------------------------------------------------------
 
 struct Parallel
@@ -274,11 +409,17 @@ std::vector<range_type> getBounds(range_type range, size_type blocks);
   object is destroyed or when join() is explicitly called.
 
   Like with std::thread, use std::ref() to give references as arguments to execute().
+
+  The second constructor uses the given blocks, which must be consecutive ranges. With
+  guided scheduling, next() returns the union of max(1, remaining / (2 * threads))
+  consecutive blocks, so the threads take large chunks of work first and single blocks
+  near the end.
 */
 class ParallelLoop
 {
 public:
   ParallelLoop(size_type start, size_type limit, size_type block_count, size_type thread_count);
+  ParallelLoop(const std::vector<range_type>& _blocks, size_type thread_count, bool _guided);
   ~ParallelLoop();
 
   ParallelLoop(const ParallelLoop&) = delete;
@@ -298,6 +439,7 @@ public:
 
   std::atomic<size_type>   tail;
   std::vector<range_type>  blocks;
+  bool                     guided;
   std::vector<std::thread> threads;
 };
 